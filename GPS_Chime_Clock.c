@@ -25,18 +25,31 @@
 #include <stdio.h>  
 #include <string.h>
 #include <math.h>
+#ifdef HOST_BUILD
+// Native build for benchmarking - see host/hal_host.h
+#include "host/hal_host.h"
+#else
 #include <avr/io.h>
 #include <avr/eeprom.h>
 #include <avr/power.h>
+#include <avr/sleep.h>
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <util/atomic.h>
+#endif
 
 // UBRR?_VALUE macros defined here are used below in serial initialization in main()
 #define F_CPU (8000000UL)
 #define BAUD 9600
+#ifndef HOST_BUILD
 #include <util/setbaud.h>
+#endif
+
+// The receiver can be switched to this once it's in binary mode. 115200
+// is 3.5% off from what an 8 MHz clock can divide down to - too far.
+#define BAUD_FAST 38400
+#define UBRR_FAST ((F_CPU + 8UL * BAUD_FAST) / (16UL * BAUD_FAST) - 1)
 
 /* EEPROM:
 
@@ -44,6 +57,18 @@
 1 DST
 2 start hour
 3 end hour
+4 holdover window, in hours
+5 receiver output: 0 NMEA, 1 binary, 2 binary at 38400 baud
+6 1 to have the receiver keep its output settings in flash (not the baud rate)
+7 timing bus: 1 to send a timing frame every second, 2 to follow them when
+  there's no fix. Anything else for neither.
+8 timing bus delay beyond the first byte of a frame, in 32 us units
+9 1 to play synthesized bells through an amplifier on PA5 instead of
+  striking the solenoids
+16-25 custom time zone rule (struct tz_rule), when DST is DST_CUSTOM
+32-41 chime calibration: lead time and pulse width (ms) for each channel
+48-75 chiming hours for each day of the week, Sunday first (struct chime_sched).
+      0xffff to use the start and end hour.
 
 */
 
@@ -51,6 +76,15 @@
 #define EE_DST_MODE ((void*)1)
 #define EE_START_HOUR ((void*)2)
 #define EE_END_HOUR ((void*)3)
+#define EE_HOLDOVER ((void*)4)
+#define EE_GPS_MODE ((void*)5)
+#define EE_GPS_SAVE ((void*)6)
+#define EE_SYNC_ROLE ((void*)7)
+#define EE_SYNC_DELAY ((void*)8)
+#define EE_OUTPUT ((void*)9)
+#define EE_TZ_RULE ((void*)16)
+#define EE_CHIME_CAL ((void*)32)
+#define EE_SCHEDULE ((void*)48)
 
 /* Hardware:
 
@@ -67,557 +101,2057 @@ PA2: TX
 PA1: RX
 PA0: CH0
 
+On a timing bus (see SYNC_MSG_ID), each follower's RX has to hear both its
+own receiver's TX and the master's. Both are push-pull outputs, so they
+mustn't be tied together. Put a Schottky diode from the RX node to each
+TX (cathode at the TX) and a 10k pull-up on the node, which makes a wired
+AND - either one sending a 0 pulls it low. A 74LVC1G08 AND gate does the
+same. The master's TX gets a diode to every follower's node, and still
+goes straight to its own receiver.
+
 */
 
-// The millisecond timer. 8 MHz divided by 256 is 31.25 kHz. So we
-// count to 32 once, and 31 3 times.
+// How long to hold off declaring the PPS missing.
+#define PPS_GRACE (20)
+
+// The millisecond clock. TIMER2 runs free at 8 MHz / 256 = 31.25 kHz, and
+// its overflow interrupt extends it to a 32 bit count. Nothing interrupts
+// every millisecond: the main loop works out how many ticks have gone by
+// from the count whenever it wakes up, a tick being nominally 31.25 counts
+// (carried with a 16 bit fraction). pps_discipline() measures the (RC)
+// oscillator against the PPS and adjusts the tick length to match. The
+// compare units wake us when something's due: A for the end of a solenoid
+// pulse, and B for the main loop's next deadline.
 
-#define TICK_BASE_CYCLE (31)
-#define TICK_CYCLE_LENGTH (4)
-#define TICK_NUM_LONG (1)
+// 31.25 counts per tick, in 1/65536ths of a count
+#define TICK_NOMINAL (2048000UL)
+// How much of the difference between the measured and current rate to
+// take each second (as a shift)
+#define TICK_RATE_GAIN (3)
 
 // This is the timer frequency - we're aiming for a millisecond timer
 #define F_TICK (1000UL)
 
-// One second beats
-#define BEAT_TIME (F_TICK)
-
-// How long to energize the solenoid? 166 ms.
-#define SOLENOID_ON (25UL)
+// The longest the main loop sleeps, in ticks. Under half the watchdog
+// timeout, with room for the loop's own work between the wdr and the
+// sleep, and it keeps the count within a few thousand of where ticks is at.
+#define TICK_WAKE_MAX (100)
 
-// These are return values from the DST detector routine.
-// DST is not in effect all day
-#define DST_NO 0
-// DST is in effect all day
-#define DST_YES 1
-// DST begins at 0200
-#define DST_BEGINS 2
-// DST ends 0300 - that is, at 0200 pre-correction.
-#define DST_ENDS 3
+// How long to energize a solenoid, in ticks, unless its calibration says
+// otherwise.
+#define SOLENOID_ON (25)
 
-// The possible values for dst_mode
+// The possible values for dst_mode. The first five use the timezone
+// (whole hours) from EEPROM and one of the built-in rules. DST_CUSTOM
+// uses a complete rule stored in EEPROM at EE_TZ_RULE.
 #define DST_OFF 0
 #define DST_US 1
 #define DST_EU 2
 #define DST_AU 3
 #define DST_NZ 4
-#define DST_MODE_MAX DST_NZ
+#define DST_CUSTOM 5
+#define DST_MODE_MAX DST_CUSTOM
+
+// A time zone rule. This is the compact form of a POSIX TZ string like
+// CET-1CEST,M3.5.0,M10.5.0/3 (host/tzrule turns one into EEPROM contents),
+// with offsets and times in quarter hours. Only the Mm.w.d form of the
+// DST change dates is supported.
+struct tz_rule {
+	int8_t std_offset; // standard time, east of UTC
+	int8_t dst_offset; // daylight time, east of UTC
+	uint8_t start_month; // 1-12, or 0 for no DST at all
+	uint8_t start_week; // 1-4, or 5 for the last one in the month
+	uint8_t start_dow; // 0 is Sunday
+	int8_t start_time; // since local midnight, standard time
+	uint8_t end_month;
+	uint8_t end_week;
+	uint8_t end_dow;
+	int8_t end_time; // since local midnight, daylight time
+};
 
 uint8_t hour, minute, second;
-uint8_t tz_hour, dst_mode;
+uint8_t dst_mode;
+struct tz_rule tz;
 uint8_t start_hour, end_hour;
 
-uint32_t song_start;
-int8_t song_pos;
-const uint8_t *song;
-size_t song_length;
+// A day's chiming hours, in minutes after local midnight, little endian.
+// Both ends are inclusive. If start is after end, it's from start until
+// midnight and from midnight until end.
+struct chime_sched {
+	uint16_t start;
+	uint16_t end;
+};
+
+// Which quarters chime today, a bit each. Bit n is for the quarter that
+// ends n + 1 quarters after local midnight, so the last one is midnight
+// tomorrow (and goes by tomorrow's schedule). It's worked out at the start
+// of each local day, so checking a quarter is one bit test.
+#define PLAN_QUARTERS (96)
+uint8_t chime_plan[PLAN_QUARTERS / 8];
+uint32_t plan_day; // local days since 2000
+
+const uint8_t *song; // NULL when there's no song playing
+uint8_t song_pos, song_length;
 
 volatile uint8_t new_second;
-volatile uint32_t ticks;
+// Milliseconds, as of the main loop's last look at the timer.
+uint32_t ticks;
+
+// The top half of the 32 bit timer count
+volatile uint16_t timer_high;
+
+// Where the current tick started (in counts, and 1/65536ths of one), the
+// tick length in use (in 1/65536ths of a count) and 2^32 over that.
+uint32_t tick_count;
+uint16_t tick_count_frac;
+uint32_t tick_len;
+uint16_t tick_recip;
+// The measured tick rate, in 1/65536ths of a count
+uint32_t tick_rate;
+
+// The timer count at the last PPS edge, and the tick boundary nearest it
+// and how far after that it was (in 1/256ths of a count, negative if it
+// was just before)
+volatile uint32_t pps_raw;
+uint32_t pps_ticks;
+int16_t pps_into;
 
 uint8_t gps_locked;
+
+// Once the receiver's time has agreed with our own count for PPS_AGREE
+// seconds running, we count the seconds from the PPS alone. Its time is
+// then only looked at every PPS_CHECK seconds, through the last minute of
+// each UTC day (when there'd be a leap second) and in the minute before a
+// time zone change, and any disagreement goes back to taking every one.
+// In between, the RX ISR only reads each RMC's status, so that a lost fix
+// still stops the count at once.
+#define PPS_AGREE (3)
+#define PPS_CHECK (10)
+uint8_t pps_counting;
+uint8_t pps_agreed;
+volatile uint8_t gps_time_wanted;
+
+// How the receiver's time labels line up with the PPS. Each message is
+// stamped with how long after the last edge it came in, and we keep a
+// running average of that. A label that comes in more than RX_SLACK away
+// from it was held up (or came early) and is ignored - unless RX_RELEARN
+// of them in a row say the receiver has changed what it sends, and we
+// start over. Most receivers label the edge just gone. One whose labels
+// come in the last part of the second is labelling the edge to come.
+#define COUNT_MS(ms) ((ms) * (F_CPU / 256) / 1000)
+#define RX_SLACK COUNT_MS(200)
+#define RX_AHEAD COUNT_MS(750)
+#define RX_RELEARN (4)
+uint16_t rx_phase;
+uint8_t rx_phase_rejects; // in a row
+uint8_t rx_ahead; // 1 if the labels are for the edge to come
+// While counting, one label that doesn't fit our count is more likely late
+// than the receiver having jumped. We wait for the next one to say so too.
+uint8_t rx_mismatched;
+
+// Whether the time has ever been set, and whether handle_time() has set it
+// since the start of the current second.
+uint8_t time_set;
+uint8_t time_fresh;
+
+// When the current second started, from the PPS or made up by us.
+uint32_t second_tick;
+
+// In holdover, we carry on without the PPS (or without a fix) for as long as
+// the window from EEPROM allows, counting seconds with the disciplined timer.
+uint8_t holdover;
+uint8_t second_synthesized;
+uint32_t holdover_left;
+uint32_t holdover_window;
 uint16_t utc_ref_year;
 uint8_t utc_ref_mon;
 uint8_t utc_ref_day;
 
-// Serial buffer stuff
-#define RX_BUF_LEN (96)
+// Channels 0-3 are the 4 quarters notes, low to high. Channel 4 is the hourly chime.
+// A chord is a bitmask of channels.
+#define CHANNELS (5)
+
+// Map a chord onto the port pins: CH0 is PA0, CH1 is PA3, CH2-CH4 are PB0-PB2.
+static inline uint8_t chord_porta(uint8_t chord) { return (chord & 0x01) | ((chord & 0x02) << 2); }
+static inline uint8_t chord_portb(uint8_t chord) { return chord >> 2; }
+
+// The channels that are energized, and the timer count to turn each off at.
+volatile uint8_t solenoids_on;
+volatile uint16_t solenoid_off[CHANNELS];
+
+// Each chime takes a while from when its solenoid is energized to when it
+// sounds, and some need a shorter or longer pulse than others. Both are in
+// ticks, from EEPROM at EE_CHIME_CAL.
+struct chime_cal {
+	uint8_t lead;
+	uint8_t pulse;
+};
+struct chime_cal chime_cal[CHANNELS];
+// How far ahead song steps and hour strikes are set up: the longest lead,
+// and CHIME_SETUP more, so that the strike is already queued when its tick
+// comes and all the main loop has to do then is energize it.
+#define CHIME_SETUP (2)
+uint16_t chime_ahead;
+
+#ifdef WITH_SYNTH
+// Instead of the solenoids, the chimes can be synthesized bells, played
+// through an amplifier. TIMER1 makes 8 bit PWM at 31.25 kHz on PA5, and
+// TIMER0 interrupts SYNTH_RATE times a second for the next sample, mixing
+// a voice for each channel from a wavetable. A voice starts loud when its
+// channel is struck and gets 3 dB quieter every SYNTH_DECAY samples, until
+// it's SYNTH_SILENT. The interrupt only runs while something's sounding.
+//
+// There's no MUL, so a voice's level is a shift and a choice of two
+// tables, the second 3 dB down from the first. The interrupt doesn't let
+// the others in - there isn't the stack for them to pile up on it - so
+// it's budgeted 400 cycles of the 1000 between samples. While a bell
+// sounds, a PPS edge can be timed that much late, which the oscillator
+// discipline averages out, and the UART's receive buffer covers it. make
+// sim with -a checks both.
+#define SYNTH_RATE (8000)
+#define SYNTH_TOP (F_CPU / 8 / SYNTH_RATE - 1) // TIMER0, prescaled by 8
+#define SYNTH_DECAY (1000) // 1.75 seconds from loud to silent
+// By then the shift leaves every sample 0 or -1, which the PWM can't make
+// anything of, and a voice that's still mixed costs the same as a loud one.
+#define SYNTH_SILENT (14)
+#define SYNTH_MID (128) // no sound
+
+// The phase step for a note of the given frequency. The wavetable is two
+// of its cycles.
+#define SYNTH_STEP(hz) ((uint16_t)((hz) * 32768.0 / SYNTH_RATE + 0.5))
+
+uint8_t chime_synth;
+// Each voice's phase and its note's phase step, and how far (in 3 dB
+// steps) it's died away. The interrupt works from the table and the shift
+// for that, which only change when it does. It's eight bytes, so finding
+// the one to decay doesn't take a multiply.
+struct synth_voice {
+	uint16_t phase;
+	uint16_t step;
+	const int8_t *wave;
+	uint8_t atten;
+	uint8_t shift;
+};
+struct synth_voice synth_voices[CHANNELS];
+uint16_t synth_env;
+#else
+#define chime_synth (0)
+#endif
+
+// Things for the main loop to do at a given tick, soonest first. Those
+// due at the same tick go in the order they were added.
+#define EVENT_STRIKE 0 // energize a chord (arg)
+#define EVENT_SONG 1 // set up the next song step, due chime_ahead from now
+#define EVENT_HOUR 2 // set up an hour strike, as above. arg is how many more.
+#define EVENT_LEAP_CHECK 3 // the hourly leap second (and UTC reference) check
+// A song step on each channel, the next song step, an hour strike and the check
+#define EVENTS (CHANNELS + 3)
+
+struct event {
+	uint32_t when;
+	uint8_t type;
+	uint8_t arg;
+};
+
+struct event events[EVENTS];
+uint8_t events_len;
+
+// Serial buffer stuff. The transmit buffer holds one whole binary message.
 #define TX_BUF_LEN (24)
 
-volatile uint8_t rx_buf[RX_BUF_LEN];
-volatile uint8_t rx_str_len;
-volatile uint8_t tx_buf[TX_BUF_LEN];
-volatile uint16_t tx_buf_head, tx_buf_tail;
-volatile uint8_t nmea_ready;
-
-const unsigned char month_tweak[] PROGMEM = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
-
-static inline unsigned char first_sunday(unsigned char m, unsigned int y) {
-	// first, what's the day-of-week for the first day of whatever month?
-	// From http://en.wikipedia.org/wiki/Determination_of_the_day_of_the_week
-	y -= m < 3;
-	unsigned char month_tweak_val = pgm_read_byte(&(month_tweak[m - 1]));
-	unsigned char dow = (y + y/4 - y/100 + y/400 + month_tweak_val + 1) % 7;
-
-	// If the 1st is a Sunday, then the answer is 1. Otherwise, we count
-	// up until we find a Sunday.
-	return (dow == 0)?1:(8 - dow);
-}
-
-static inline unsigned char calculateDSTAU(const unsigned char d, const unsigned char m, const unsigned int y) {
-        // DST is in effect between the first Sunday in October and the first Sunday in April
-        unsigned char change_day;
-        switch(m) {
-                case 1: // November through March
-                case 2:
-                case 3:
-                case 11:
-                case 12:
-                        return DST_YES;
-                case 4: // April
-                        change_day = first_sunday(m, y);
-                        if (d < change_day) return DST_YES;
-                        else if (d == change_day) return DST_ENDS;
-                        else return DST_NO;
-                        break;
-                case 5: // April through September
-                case 6:
-                case 7:
-                case 8:
-                case 9:
-                        return DST_NO;
-                case 10: // October
-                        change_day = first_sunday(m, y);
-                        if (d < change_day) return DST_NO;
-                        else if (d == change_day) return DST_BEGINS;
-                        else return DST_YES;
-                        break;
-                default: // This is impossible, since m can only be between 1 and 12.
-                        return 255;
-        }
-}
-static inline unsigned char calculateDSTNZ(const unsigned char d, const unsigned char m, const unsigned int y) {
-        // DST is in effect between the last Sunday in September and the first Sunday in April
-        unsigned char change_day;
-        switch(m) {
-                case 1: // October through March
-                case 2:
-                case 3:
-                case 10:
-                case 11:
-                case 12:
-                        return DST_YES;
-                case 4: // April
-                        change_day = first_sunday(m, y);
-                        if (d < change_day) return DST_YES;
-                        else if (d == change_day) return DST_ENDS;
-                        else return DST_NO;
-                        break;
-                case 5: // April through August
-                case 6:
-                case 7:
-                case 8:
-                        return DST_NO;
-                case 9: // September
-                        change_day = first_sunday(m, y);
-                        while(change_day + 7 <= 30) change_day += 7; // last Sunday
-                        if (d < change_day) return DST_NO;
-                        else if (d == change_day) return DST_BEGINS;
-                        else return DST_YES;
-                        break;
-                default: // This is impossible, since m can only be between 1 and 12.
-                        return 255;
-        }
-}
-static inline unsigned char calculateDSTEU(const unsigned char d, const unsigned char m, const unsigned int y) {
-        // DST is in effect between the last Sunday in March and the last Sunday in October
-        unsigned char change_day;
-        switch(m) {
-                case 1: // November through February
-                case 2:
-                case 11:
-                case 12:
-                        return DST_NO;
-                case 3: // March
-                        change_day = first_sunday(m, y);
-                        while(change_day + 7 <= 31) change_day += 7; // last Sunday
-                        if (d < change_day) return DST_NO;
-                        else if (d == change_day) return DST_BEGINS;
-                        else return DST_YES;
-                        break;
-                case 4: // April through September
-                case 5:
-                case 6:
-                case 7:
-                case 8:
-                case 9:
-                        return DST_YES;
-                case 10: // October
-                        change_day = first_sunday(m, y);
-                        while(change_day + 7 <= 31) change_day += 7; // last Sunday
-                        if (d < change_day) return DST_YES;
-                        else if (d == change_day) return DST_ENDS;
-                        else return DST_NO;
-                        break;
-                default: // This is impossible, since m can only be between 1 and 12.
-                        return 255;
-        }
-}
-static inline unsigned char calculateDSTUS(const unsigned char d, const unsigned char m, const unsigned int y) {
-	// DST is in effect between the 2nd Sunday in March and the first Sunday in November
-	// The return values here are that DST is in effect, or it isn't, or it's beginning
-	// for the year today or it's ending today.
-	unsigned char change_day;
-	switch(m) {
-		case 1: // December through February
-		case 2:
-		case 12:
-			return DST_NO;
-		case 3: // March
-			change_day = first_sunday(m, y) + 7; // second Sunday.
-			if (d < change_day) return DST_NO;
-			else if (d == change_day) return DST_BEGINS;
-			else return DST_YES;
-			break;
-		case 4: // April through October
-		case 5:
-		case 6:
-		case 7:
-		case 8:
-		case 9:
-		case 10:
-			return DST_YES;
-		case 11: // November
-			change_day = first_sunday(m, y);
-			if (d < change_day) return DST_YES;
-			else if (d == change_day) return DST_ENDS;
-			else return DST_NO;
-			break;
-		default: // This is impossible, since m can only be between 1 and 12.
-			return 255;
-	}
-}
-static inline unsigned char calculateDST(const unsigned char d, const unsigned char m, const unsigned int y) {
-        switch(dst_mode) {
-                case DST_US:
-                        return calculateDSTUS(d, m, y);
-                case DST_EU:
-                        return calculateDSTEU(d, m, y);
-                case DST_AU:
-                        return calculateDSTAU(d, m, y);
-                case DST_NZ:
-                        return calculateDSTNZ(d, m, y);
-                default: // off - should never happen
-                        return DST_NO;
-        }
-}
-
-static inline void startLeapCheck();
-
-static inline void handle_time(char h, unsigned char m, unsigned char s, unsigned char dst_flags) {
-	// What we get is the current second. We have to increment it
-	// to represent the *next* second.
-	s++;
+// Commands for the receiver. Each can be waiting to go at most once - asking
+// again just replaces the arguments. One at a time is sent, and then we
+// wait for the ACK and (for the queries) the answer before the next.
+#define CMD_SERIAL 0 // 0x05, to BAUD_FAST
+#define CMD_BINARY 1 // 0x09, binary output
+#define CMD_NMEA 2 // 0x08, RMC only
+#define CMD_UTC_REF_FETCH 3 // 0x64-0x16, answered with 0x64-0x8a
+#define CMD_UTC_REF_UPDATE 4 // 0x64-0x15
+#define CMD_LEAP_CHECK 5 // 0x64-0x20, answered with 0x64-0x8e
+#define CMD_LEAP_UPDATE 6 // 0x64-0x1f
+#define CMD_COUNT 7
+#define CMD_NONE 0xff
+
+// How long to wait for an answer (in ticks), and how many times to try.
+// Each retry waits twice as long as the one before.
+#define CMD_TIMEOUT (1000)
+#define CMD_TRIES (5)
+
+struct cmd_def {
+	uint8_t id; // message ID
+	uint8_t sub; // the sub-ID, if the ID is 0x64
+	uint8_t len; // payload length
+	uint8_t answer; // the 0x64 sub-ID of the answer, or 0 if the ACK is all
+};
+
+uint8_t cmd_pending; // a bit for each command waiting to go
+uint8_t cmd_current; // the one we're waiting on, or CMD_NONE
+uint8_t cmd_tries[CMD_COUNT];
+uint32_t cmd_deadline; // when to give up on cmd_current
+uint32_t cmd_retry_at; // nothing goes out before this, unless it's 0
+uint8_t cmd_leap_offset;
+uint16_t cmd_ref_year;
+uint8_t cmd_ref_mon, cmd_ref_day;
+
+// The receiver's output. GPS_NMEA is what it does out of the box.
+#define GPS_NMEA 0
+#define GPS_BINARY 1 // binary navigation data messages (0xA8)
+#define GPS_BINARY_FAST 2 // the same, at BAUD_FAST
+
+// If we hear nothing for this many seconds when the receiver ought to be
+// in binary mode, it's probably been reset. Start over.
+#define GPS_QUIET (10)
+
+// If more sentences than this that aren't RMC come in each of two seconds
+// once the receiver was told to send only RMC, it's been reset. Tell it
+// again. (The rest of the burst it was sending when it ACKed can still
+// come in the first.)
+#define GPS_CHATTY (2)
+
+// Clocks can share one timing source. The master's TX (which also goes to
+// its receiver, which NACKs it) is ANDed with each follower's receiver's TX
+// onto that follower's RX (see Hardware, above). The bus runs at the
+// receivers' baud rate, so set every clock to the same receiver output.
+// Where the master and a follower's receiver talk at once, both are garbled.
+// A garbled frame fails its checksum and the follower carries on by itself
+// for that second. The master's commands to its receiver go out on the bus
+// too, and the followers ignore them. Early in each second it can
+// chime in, the master sends a timing frame, a binary message with ID
+// SYNC_MSG_ID:
+//
+// ID, flags, UTC hour, minute, second, days since 2000 (3 bytes),
+// timer counts from the start of the second to sending (2 bytes)
+//
+// all big endian. A follower without a fix of its own takes the frame as
+// its PPS and its RMC. The second began one byte time (the frame's first
+// byte arrives whole), the master's delay and the EEPROM delay before the
+// first byte of the frame came in. The master's UART only starts the
+// frame on its next bit, so each edge is good to one bit time, which the
+// oscillator discipline averages down.
+#define SYNC_NONE 0
+#define SYNC_MASTER 1
+#define SYNC_FOLLOWER 2
+#define SYNC_MSG_ID 0x7e
+#define SYNC_LEN 10
+#define SYNC_LOCKED 1 // flags: the master has a fix
+#define SYNC_HOLDOVER 2 // ... or is within its holdover window
+// A byte (10 bits) at each baud rate, in timer counts
+#define SYNC_BYTE ((10 * F_CPU / 256 + BAUD / 2) / BAUD)
+#define SYNC_BYTE_FAST ((10 * F_CPU / 256 + BAUD_FAST / 2) / BAUD_FAST)
+// A frame takes 16 ms to come in at 9600 baud, so give up on it later
+// than on a PPS.
+#define SYNC_GRACE (60)
+// Don't send a frame this many timer counts (250 ms) after the second began
+#define SYNC_LATE (7812)
+
+uint8_t sync_due; // the master has a frame to send
+// sync_fresh says a frame has marked the start of a second that the main
+// loop hasn't started yet.
+uint8_t sync_fresh;
+#ifdef WITH_SYNC
+uint8_t sync_role;
+uint8_t sync_delay; // in timer counts
+// When the first byte of the last frame came in, and what it said.
+volatile uint32_t sync_rx_count;
+uint8_t sync_hour, sync_minute, sync_second;
+uint32_t sync_days;
+#else
+#define sync_role (SYNC_NONE)
+#endif
+
+uint8_t gps_save; // 1 to have the receiver save its output settings to flash
+#ifdef WITH_BINARY
+uint8_t gps_mode; // what we want, from EEPROM
+uint8_t uart_fast; // the UART is at BAUD_FAST
+uint8_t gps_binary; // the receiver has ACKed the switch to binary
+uint8_t gps_quiet; // seconds since we last heard from it
+#else
+#define gps_mode (GPS_NMEA)
+#define uart_fast (0)
+#define gps_binary (0)
+#endif
+uint8_t gps_rmc_only; // the receiver has ACKed the switch to sending only RMC
+uint8_t gps_chatty; // seconds in a row it sent more than that
+uint8_t gps_leap; // GPS - UTC in seconds, 0xff until the receiver tells us
+
+// The receive ISR parses as the bytes arrive and hands the main loop only
+// what it needs out of the messages it cares about. Everything else is
+// thrown away as soon as it's recognized.
+#define MSG_NONE 0
+#define MSG_RMC 1
+#define MSG_BINARY 2
+#define MSG_NAV 3 // binary navigation data
+#define MSG_SYNC 4 // a timing frame from the bus master
+
+// Long enough for the 0x64-0x8e GPS time message payload
+#define BIN_PAYLOAD_LEN (16)
+
+// The navigation data message is too long to keep. The ISR picks out
+// the fix mode, the GPS week and the time of week (in 10 ms units).
+#define NAV_ID 0xa8
+#define NAV_LEN 59
+#define NAV_FIX 1
+#define NAV_WEEK 3 // to 4
+#define NAV_TOW 5 // to 8
+#define RMC_NO_TIME 0xff
+
+struct gps_msg {
+	uint8_t type;
+	uint16_t age; // timer counts from the last PPS edge to when it came in, at most 0xffff
+	union {
+		struct {
+			uint8_t h, min, s; // UTC time, h RMC_NO_TIME if it wasn't wanted
+			uint8_t status; // A or V. V if any time/date digits were bad.
+			uint8_t d, mon, y; // UTC date, two digit year
+		} rmc;
+		struct {
+			uint8_t fix; // 0 for none
+			uint16_t week;
+			uint32_t tow;
+		} nav;
+		uint8_t payload[BIN_PAYLOAD_LEN]; // from the message ID on
+	};
+};
+
+// Receive slots. The ISR fills one while the main loop parses another.
+// A slot is handed over by setting its type, and handed back by setting
+// it to MSG_NONE.
+#define RX_SLOTS (2)
+
+volatile struct gps_msg rx_msg[RX_SLOTS];
+volatile uint8_t rx_slot; // the slot the ISR is filling
+uint8_t rx_parse_slot; // the next slot the main loop will parse
+// NMEA sentences we didn't want since the last second
+volatile uint8_t rx_ignored;
+
+uint8_t tx_buf[TX_BUF_LEN];
+volatile uint8_t tx_pos, tx_len; // the ISR sends tx_buf[tx_pos] up to tx_len
+
+// The 32 bit timer count, with interrupts off. If the timer has just
+// overflowed but its interrupt hasn't run yet, the count is already past it.
+static inline uint32_t timer_count_isr(void) __attribute__ ((always_inline));
+static inline uint32_t timer_count_isr(void) {
+	uint16_t count = TCNT2;
+	uint16_t high = timer_high;
+	if ((TIFR2 & _BV(TOV2)) && count < 0x8000) high++;
+	return ((uint32_t)high << 16) | count;
+}
+
+// Event trace. The last TRACE_LEN events are kept, each stamped with the
+// bottom 24 bits of the timer count (which wrap every 9 minutes). Sending a
+// TRACE_DUMP_BYTE (which no NMEA sentence has) on the serial line between
+// messages dumps them, oldest first, as binary messages with ID
+// TRACE_MSG_ID, followed by the stats. host/tracedump decodes them. Nothing
+// is recorded while the dump is going out. The buffer costs 5 bytes of RAM
+// an event, so the events are only built in with -DWITH_TRACE (see FEATURES
+// in the Makefile). Without it, the dump is just the first few stats.
+#ifdef WITH_TRACE
+#define TRACE_LEN (12)
+#else
+#define TRACE_LEN (0)
+#endif
+#define TRACE_DUMP_BYTE 0x14
+#define TRACE_MSG_ID 0x7f
+#define TRACE_PER_MSG (2)
+
+#define TRACE_PPS 1 // PPS edge
+#define TRACE_SECOND 2 // the main loop started a second, arg 1 if from the PPS
+#define TRACE_RX 3 // a message was handed to the main loop, arg the MSG_ type
+#define TRACE_CKSUM 4 // a message with a bad checksum
+#define TRACE_DROP 5 // a message dropped, arg 0 if every slot was full, 1 if too long
+#define TRACE_SONG 6 // a song started, arg the quarter (0 for the hour)
+#define TRACE_NOTE_ON 7 // arg the chord
+#define TRACE_NOTE_OFF 8 // arg the chord
+#define TRACE_CMD 9 // a command went to the receiver, arg the CMD_ number
+#define TRACE_LOCK 10 // arg 1 if the receiver has a fix, 0 if it lost it
+#define TRACE_SYNC 11 // a timing frame marked a second, arg its flags
+#define TRACE_COUNTING 12 // arg 1 if counting seconds from the PPS alone, 0 if not anymore
+#define TRACE_LATE 13 // a time label came in outside its window, arg how long after the PPS in 256 counts
+
+// What's been counted since the clock started, sent after the events in a
+// dump, in this order, low byte first. The ISRs write some of these, so the
+// dump copies them with interrupts off. The first few are always kept, and
+// set directly. The rest are only kept with -DWITH_TRACE, and set through
+// STAT_INC/STAT_SET, which are nothing without it.
+struct stats {
+	uint16_t rx_overruns; // messages lost because every slot was full
+	uint16_t rx_overflows; // binary messages too long to keep
+	uint16_t rx_checksum_errors; // and NMEA sentences with bad checksums
+	int16_t pps_phase_us; // the last PPS edge from a tick boundary (positive is after)
+	int16_t osc_ppm; // the estimated oscillator error (positive is fast)
+	int16_t holdover_drift_ms; // how far off our seconds were when the PPS came back (positive is late)
+#ifdef WITH_TRACE
+	uint16_t pps_checks, pps_check_fails; // times checked against the receiver while counting
+	uint16_t rx_late, rx_mismatches; // time labels outside their window, and that didn't fit our count
+	uint16_t event_overflows; // events that didn't fit
+	uint16_t cmd_failures, cmd_nacks, cmd_unsolicited; // commands given up on, NACKs, answers nobody asked for
+	uint32_t pps_counted; // seconds counted from the PPS alone
+	uint32_t holdover_seconds; // how long the last holdover went on
+#endif
+};
+struct stats stats;
+
+// The dump sends the events, then the stats a piece at a time.
+#define TRACE_STATS_PER_MSG (12)
+#define TRACE_DUMP_END (TRACE_LEN + sizeof(struct stats))
+
+volatile uint8_t trace_dump_asked;
+uint8_t trace_dump_pos; // the next one to send, or TRACE_DUMP_END if we aren't
+#define trace_dumping() (trace_dump_pos != TRACE_DUMP_END)
+
+#ifdef WITH_TRACE
+
+#define STAT_INC(x) (stats.x++)
+#define STAT_SET(x, v) (stats.x = (v))
+
+struct trace_ev {
+	uint8_t type;
+	uint8_t arg;
+	uint8_t high; // the timer count, bits 16-23
+	uint16_t count; // and 0-15
+};
+
+struct trace_ev trace_buf[TRACE_LEN];
+uint8_t trace_pos; // the next one to write, which is also the oldest
+
+// Record an event with interrupts off - in an ISR or an ATOMIC_BLOCK. This
+// is inlined so that the ISRs don't have to save registers for a call.
+static inline void trace_isr(uint8_t type, uint8_t arg) __attribute__ ((always_inline));
+static inline void trace_isr(uint8_t type, uint8_t arg) {
+	if (trace_dump_pos != TRACE_DUMP_END) return;
+	uint32_t t = timer_count_isr();
+	struct trace_ev *ev = &(trace_buf[trace_pos]);
+	ev->type = type;
+	ev->arg = arg;
+	ev->high = t >> 16;
+	ev->count = t;
+	if (++trace_pos == TRACE_LEN) trace_pos = 0;
+}
+
+static void trace(uint8_t type, uint8_t arg) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		trace_isr(type, arg);
+	}
+}
+
+#else
+
+static inline void trace_isr(uint8_t type, uint8_t arg) { }
+static inline void trace(uint8_t type, uint8_t arg) { }
+
+#define STAT_INC(x)
+#define STAT_SET(x, v) ((void)(v))
+
+#endif
+
+// The built-in rules, in dst_mode order. The offsets come from the
+// EEPROM timezone.
+const struct tz_rule PROGMEM tz_presets[] = {
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // DST_OFF
+	{ 0, 4, 3, 2, 0, 8, 11, 1, 0, 8 }, // DST_US: M3.2.0,M11.1.0
+	{ 0, 4, 3, 5, 0, 4, 10, 5, 0, 4 }, // DST_EU: M3.5.0,M10.5.0 at 0100 UTC
+	{ 0, 4, 10, 1, 0, 8, 4, 1, 0, 12 }, // DST_AU: M10.1.0,M4.1.0/3
+	{ 0, 4, 9, 5, 0, 8, 4, 1, 0, 12 }, // DST_NZ: M9.5.0,M4.1.0/3
+};
+
+static inline uint8_t tz_change_valid(uint8_t month, uint8_t week, uint8_t dow) {
+	return month >= 1 && month <= 12 && week >= 1 && week <= 5 && dow < 7;
+}
+
+static void tz_load(void) {
+	dst_mode = eeprom_read_byte(EE_DST_MODE);
+	if (dst_mode == DST_CUSTOM) {
+		eeprom_read_block(&tz, EE_TZ_RULE, sizeof(tz));
+		if (tz.start_month == 0) return; // no DST
+		if (tz_change_valid(tz.start_month, tz.start_week, tz.start_dow)
+			&& tz_change_valid(tz.end_month, tz.end_week, tz.end_dow)) return;
+		dst_mode = DST_US; // it's garbage
+	}
+	if (dst_mode > DST_MODE_MAX) dst_mode = DST_US;
+	memcpy_P(&tz, &(tz_presets[dst_mode]), sizeof(tz));
+
+	uint8_t ee_rd = eeprom_read_byte(EE_TIMEZONE);
+	int8_t tz_hour = (ee_rd == 0xff)?-8:(ee_rd - 12);
+	tz.std_offset = tz_hour * 4;
+	tz.dst_offset += tz.std_offset;
+	if (dst_mode == DST_EU) {
+		// Europe changes everywhere at once, at 0100 UTC.
+		tz.start_time += tz.std_offset;
+		tz.end_time += tz.dst_offset;
+	}
+}
+
+// Dates are kept as days since 1 Jan 2000 (a Saturday) and instants
+// as minutes since then, UTC.
+const uint16_t PROGMEM days_before_month[] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+
+static inline uint8_t is_leap(uint16_t y) {
+	return !(y % 4) && ((y % 100) || !(y % 400));
+}
+
+static uint32_t days_since_2000(uint16_t y, uint8_t m, uint8_t d) {
+	uint16_t years = y - 2000;
+	// Leap years before this one. 2000 itself is one.
+	uint32_t days = years * 365UL + (years + 3) / 4 - (years + 99) / 100 + (years + 399) / 400;
+	days += pgm_read_word(&(days_before_month[m - 1]));
+	if (m > 2 && is_leap(y)) days++;
+	return days + d - 1;
+}
+
+// The UTC instant of a DST change: the week'th dow of the month in year y,
+// at time (in the local time with the given offset)
+static uint32_t tz_change(uint16_t y, uint8_t m, uint8_t week, uint8_t dow, int8_t time, int8_t offset) {
+	uint32_t first = days_since_2000(y, m, 1);
+	uint8_t first_dow = (first + 6) % 7;
+	uint8_t d = 1 + (dow + 7 - first_dow) % 7 + (week - 1) * 7;
+	uint8_t month_days = ((m == 12)?31:(pgm_read_word(&(days_before_month[m])) - pgm_read_word(&(days_before_month[m - 1]))));
+	if (m == 2 && is_leap(y)) month_days++;
+	while (d > month_days) d -= 7; // week 5 means the last one
+	return (first + d - 1) * 1440 + (time - offset) * 15L;
+}
+
+// The offset from UTC that's in effect now, split so that no division
+// is needed to apply it. tz_offset_min is always positive.
+int8_t tz_offset_hour;
+uint8_t tz_offset_min;
+// When the offset next changes. Until then, there's nothing to work out.
+uint32_t tz_next_change;
+// The start of the UTC day we're in (in minutes and days since 2000),
+// and which day of the month that was.
+uint32_t utc_day_start;
+uint32_t utc_days;
+uint8_t utc_day;
+// The UTC time of the coming second, within that day, and the year.
+uint8_t utc_hour, utc_minute, utc_second;
+uint16_t utc_year;
+
+static void tz_set_offset(int8_t offset) {
+	int16_t minutes = offset * 15;
+	tz_offset_hour = 0;
+	while (minutes < 0) { minutes += 60; tz_offset_hour--; }
+	while (minutes >= 60) { minutes -= 60; tz_offset_hour++; }
+	tz_offset_min = minutes;
+}
+
+// Work out the offset in effect at now (in year y), and when it changes next.
+static void tz_update(uint32_t now, uint16_t y) {
+	if (tz.start_month == 0) {
+		tz_set_offset(tz.std_offset);
+		tz_next_change = 0xffffffff;
+		return;
+	}
+	uint32_t start = tz_change(y, tz.start_month, tz.start_week, tz.start_dow, tz.start_time, tz.std_offset);
+	uint32_t end = tz_change(y, tz.end_month, tz.end_week, tz.end_dow, tz.end_time, tz.dst_offset);
+	uint8_t in_dst;
+	if (start < end) {
+		in_dst = now >= start && now < end;
+	} else {
+		// southern hemisphere - DST is in effect at the start of the year.
+		in_dst = now >= start || now < end;
+	}
+	tz_set_offset(in_dst?tz.dst_offset:tz.std_offset);
+
+	uint32_t earlier = (start < end)?start:end;
+	uint32_t later = (start < end)?end:start;
+	if (now < earlier) tz_next_change = earlier;
+	else if (now < later) tz_next_change = later;
+	else {
+		// Both of this year's are done. The next is the first one next year.
+		start = tz_change(y + 1, tz.start_month, tz.start_week, tz.start_dow, tz.start_time, tz.std_offset);
+		end = tz_change(y + 1, tz.end_month, tz.end_week, tz.end_dow, tz.end_time, tz.dst_offset);
+		tz_next_change = (start < end)?start:end;
+	}
+}
+
+static void sched_load(uint32_t day, struct chime_sched *sched) {
+	// 2000-01-01 was a Saturday
+	eeprom_read_block(sched, (uint8_t *)EE_SCHEDULE + ((day + 6) % 7) * sizeof(*sched), sizeof(*sched));
+	if (sched->start >= 1440 || sched->end >= 1440) {
+		sched->start = start_hour * 60;
+		sched->end = end_hour * 60 + 59;
+	}
+}
+
+static uint8_t sched_chimes(const struct chime_sched *sched, uint16_t minute) {
+	if (sched->start <= sched->end) return minute >= sched->start && minute <= sched->end;
+	return minute >= sched->start || minute <= sched->end;
+}
+
+// Work out which quarters chime on the local day (days since 2000).
+static void plan_compile(uint32_t day) {
+	struct chime_sched today, tomorrow;
+	sched_load(day, &today);
+	sched_load(day + 1, &tomorrow);
+	memset(chime_plan, 0, sizeof(chime_plan));
+	uint16_t minute = 0;
+	for(uint8_t q = 0; q < PLAN_QUARTERS - 1; q++) {
+		minute += 15;
+		if (sched_chimes(&today, minute)) chime_plan[q >> 3] |= _BV(q & 7);
+	}
+	if (sched_chimes(&tomorrow, 0)) chime_plan[(PLAN_QUARTERS - 1) >> 3] |= _BV((PLAN_QUARTERS - 1) & 7);
+	plan_day = day;
+}
+
+// Whether the quarter the current one leads up to chimes.
+static inline uint8_t plan_chimes(void) {
+	uint8_t q = hour * 4 + minute / 15;
+	return chime_plan[q >> 3] & _BV(q & 7);
+}
+
+// Work out the local time of the coming second from the UTC time, and the
+// chime plan if it's a new local day.
+static void set_local_time(void) {
+	int8_t h = utc_hour;
+	uint8_t m = utc_minute;
+	uint32_t day = utc_days;
+
+	uint32_t now = utc_day_start + h * 60 + m;
+	if (now >= tz_next_change) tz_update(now, utc_year);
+
+	// Move to local time.
+	m += tz_offset_min;
+	if (m >= 60) { m -= 60; h++; }
+	h += tz_offset_hour;
+	while (h >= 24) {
+		h -= 24;
+		day++;
+	}
+	while (h < 0) {
+		h += 24;
+		day--;
+	}
+
+	hour = h;
+	minute = m;
+	second = utc_second;
+	if (day != plan_day) plan_compile(day);
+}
+
+// Move on to the next second by ourselves, when there's no RMC to say what it is.
+static void advance_time(void) {
+	if (++utc_second >= 60) {
+		utc_second = 0;
+		if (++utc_minute >= 60) {
+			utc_minute = 0;
+			if (++utc_hour >= 24) {
+				utc_hour = 0;
+				utc_day_start += 1440;
+				utc_days++;
+				utc_day = 0; // we don't know what day of the month it is anymore
+			}
+		}
+	}
+	set_local_time();
+}
+
+static inline void handle_time(int8_t h, unsigned char m, unsigned char s, uint8_t d, uint8_t mon, uint16_t y) {
+	// What we usually get is the current second. We have to increment it
+	// to represent the *next* second - unless the receiver labels the
+	// edge to come.
+	if (!rx_ahead) s++;
 	// Note that this also handles leap-seconds. We wind up pinning to 0
 	// twice.
 	if (s >= 60) { s = 0; m++; }
 	if (m >= 60) { m = 0; h++; }
-	if (h >= 24) { h = 0; }
-
-	// Move to local standard time.
-	h += tz_hour;
-	while (h >= 24) h -= 24;
-	while (h < 0) h += 24;
-
-	if (dst_mode != DST_OFF) {
-		unsigned char dst_offset = 0;
-		// For Europe, decisions are at 0100. Everywhere else it's 0200.
-		unsigned char decision_hour = (dst_mode == DST_EU)?1:2;
-		switch(dst_flags) {
-			case DST_NO: dst_offset = 0; break; // do nothing
-			case DST_YES: dst_offset = 1; break; // add one hour
-			case DST_BEGINS:
-				dst_offset = (h >= decision_hour)?1:0; // offset becomes 1 at 0200 (0100 EU)
-				break;
-                        case DST_ENDS:
-				// The *summer time* hour has to be the decision hour,
-				// and we haven't yet made 'h' the summer time hour,
-				// so compare it to one less than the decision hour.
-                                dst_offset = (h >= (decision_hour - 1))?0:1; // offset becomes 0 at 0200 (daylight) (0100 EU)
-				break;
-		}
-		h += dst_offset;
-		if (h >= 24) h -= 24;
+
+	// Once a day, find where in time we are. Starting over also takes
+	// care of the clock having jumped.
+	if (d != utc_day) {
+		utc_day = d;
+		utc_days = days_since_2000(y, mon, d);
+		utc_day_start = utc_days * 1440UL;
+		tz_next_change = 0;
+	}
+	if (h >= 24) {
+		// It's the start of tomorrow.
+		h = 0;
+		utc_day_start += 1440;
+		utc_days++;
+		utc_day = 0;
 	}
 
-	// Every hour, check to see if the leap second value in the receiver is out-of-date
-	unsigned char doLeapCheck = (m == 30 && s == 0);
+	utc_hour = h;
+	utc_minute = m;
+	utc_second = s;
+	utc_year = y;
+	set_local_time();
+	time_set = 1;
+	time_fresh = 1;
+}
 
-	hour = h;
-	minute = m;
-	second = s;
-
-	if (doLeapCheck) startLeapCheck();
-}
-
-static inline void tx_char(const unsigned char c);
-static inline void write_msg(const unsigned char *msg, const size_t length) {
-	for(int i = 0; i < length; i++) {
-		tx_char(msg[i]);
-	}
- }
- 
-const unsigned char PROGMEM leap_check_msg[] = { 0xa0, 0xa1, 0x00, 0x02, 0x64, 0x20, 0x44, 0x0d, 0x0a };
-static inline void startLeapCheck(void) {
-	// Ask for the time message. We expect a 0x64-0x8e in response
-	unsigned char msg[sizeof(leap_check_msg)];
-	memcpy_P(msg, leap_check_msg, sizeof(leap_check_msg));
-	write_msg(msg, sizeof(msg));
-}
-
-const unsigned char PROGMEM leap_update_msg[] = { 0xa0, 0xa1, 0x00, 0x04, 0x64, 0x1f, 0x00, 0x01, 0x7a, 0x0d, 0x0a };
-static inline void updateLeapDefault(const unsigned char leap_offset) {
-	// This is a set leap-second default message. It will write the given
-	// offset to flash.
-	unsigned char msg[sizeof(leap_update_msg)];
-	memcpy_P(msg, leap_update_msg, sizeof(leap_update_msg));
-	msg[6] = leap_offset;
-	msg[8] ^= leap_offset; // fix the checksum
-	write_msg(msg, sizeof(msg));
-}
-
-const unsigned char PROGMEM get_utc_ref_msg[] = { 0xa0, 0xa1, 0x00, 0x02, 0x64, 0x16, 0x72, 0x0d, 0x0a };
-static inline void startUTCReferenceFetch() {
-	// This is a request for UTC reference date message. We expect a 0x64-0x8a in response
-	unsigned char msg[sizeof(get_utc_ref_msg)];
-	memcpy_P(msg, get_utc_ref_msg, sizeof(get_utc_ref_msg));
-	write_msg(msg, sizeof(msg));
-}
-
-const unsigned char PROGMEM utc_ref_msg[] = { 0xa0, 0xa1, 0x00, 0x08, 0x64, 0x15, 0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x71, 0x0d, 0x0a };
-static inline void updateUTCReference(const unsigned int y, const unsigned char mon, const unsigned char d) {
-	// This sets the UTC reference date, which controls the boundaries of the GPS week window
-	unsigned char msg[sizeof(utc_ref_msg)];
-	memcpy_P(msg, utc_ref_msg, sizeof(utc_ref_msg));
-	msg[7] = (unsigned char)(y >> 8);
-	msg[8] = (unsigned char)y;
-	msg[9] = mon;
-	msg[10] = d;
-	for(int i = 7; i <= 10; i++) msg[12] ^= msg[i]; // fix checksum
-	write_msg(msg, sizeof(msg));
-}
-
-static const char *skip_commas(const char *ptr, const int num) {
-	for(int i = 0; i < num; i++) {
-		ptr = strchr(ptr, ',');
-		if (ptr == NULL) return NULL; // not enough commas
-		ptr++; // skip over it
-	}
-	return ptr;
-}
-
-const char hexes[] PROGMEM = "0123456789abcdef";
-
-static uint8_t hexChar(uint8_t c) {
-	if (c >= 'A' && c <= 'F') c += ('a' - 'A'); // make lower case
-	const char* outP = strchr_P(hexes, c);
-	if (outP == NULL) return 0;
-	return (uint8_t)(outP - hexes);
-}
-
-static inline void handleGPS() {
-	uint16_t str_len = rx_str_len; // rx_str_len is where the \0 was written.
-
-	if (str_len >= 3 && rx_buf[0] == 0xa0 && rx_buf[1] == 0xa1) { // binary protocol message
-		uint16_t payloadLength = (((uint16_t)rx_buf[2]) << 8) | rx_buf[3];
-		if (str_len != payloadLength + 7) return; // the A0, A1 bytes, length and checksum are added
-		uint16_t checksum = 0;
-		for(int i = 0; i < payloadLength; i++) checksum ^= rx_buf[i + 4];
-		if (checksum != rx_buf[payloadLength + 4]) return; // checksum mismatch
-		if (rx_buf[4] == 0x64 && rx_buf[5] == 0x8a) {
-			utc_ref_year = (rx_buf[3 + 4] << 8) | rx_buf[3 + 5];
-			utc_ref_mon = rx_buf[3 + 6];
-			utc_ref_day = rx_buf[3 + 7];
-		} else if (rx_buf[4] == 0x64 && rx_buf[5] == 0x8e) {
-			if (!(rx_buf[15 + 3] & (1 << 2))) return; // GPS leap seconds invalid
-			if (rx_buf[13 + 3] == rx_buf[14 + 3]) return; // Current and default agree
-			updateLeapDefault(rx_buf[14 + 3]);
-		} else {
-			return; // unknown binary protocol message
-		}
+static uint32_t timer_value(void);
+
+// 9600 baud, or BAUD_FAST
+static void uart_baud(uint8_t fast) {
+#ifdef WITH_BINARY
+	uart_fast = fast;
+	if (fast) {
+		UBRR0H = UBRR_FAST >> 8;
+		UBRR0L = UBRR_FAST & 0xff;
+		UCSR0A = 0;
+		return;
 	}
+#endif
+	UBRR0H = UBRRH_VALUE;
+	UBRR0L = UBRRL_VALUE;
+#if USE_2X
+	UCSR0A = _BV(U2X0);
+#else
+	UCSR0A = 0;
+#endif
+}
+
+const struct cmd_def PROGMEM cmd_defs[CMD_COUNT] = {
+	{ 0x05, 0, 4, 0 }, // CMD_SERIAL
+	{ 0x09, 0, 3, 0 }, // CMD_BINARY
+	{ 0x08, 0, 9, 0 }, // CMD_NMEA
+	{ 0x64, 0x16, 2, 0x8a }, // CMD_UTC_REF_FETCH
+	{ 0x64, 0x15, 8, 0 }, // CMD_UTC_REF_UPDATE
+	{ 0x64, 0x20, 2, 0x8e }, // CMD_LEAP_CHECK
+	{ 0x64, 0x1f, 4, 0 }, // CMD_LEAP_UPDATE
+};
+
+// Ask for a command to be sent. This never waits.
+static inline void cmd_post(uint8_t cmd) {
+	cmd_pending |= _BV(cmd);
+}
+
+// Build the command's message in the transmit buffer and start the ISR
+// sending it. The buffer has to be free.
+static void tx_send(uint8_t len);
+
+static void cmd_send(uint8_t cmd) {
+	uint8_t len = pgm_read_byte(&(cmd_defs[cmd].len));
+	uint8_t *payload = tx_buf + 4;
+	payload[0] = pgm_read_byte(&(cmd_defs[cmd].id));
+	payload[1] = pgm_read_byte(&(cmd_defs[cmd].sub));
+	switch(cmd) {
+#ifdef WITH_BINARY
+		case CMD_SERIAL:
+			payload[1] = 0; // COM1
+			payload[2] = 3; // 38400
+			payload[3] = 0; // never to flash, or we'd have no way to reach it after a reset
+			break;
+		case CMD_BINARY:
+			payload[1] = 2; // binary
+			payload[2] = gps_save;
+			break;
+#endif
+		case CMD_NMEA:
+			// The interval (in seconds, 0 for never) for GGA, GSA, GSV, GLL, RMC, VTG, ZDA
+			memset(payload + 1, 0, 7);
+			payload[5] = 1; // RMC
+			payload[8] = gps_save;
+			break;
+		case CMD_UTC_REF_UPDATE:
+			// This sets the UTC reference date, which controls the boundaries of the GPS week window
+			payload[2] = 1; // enable
+			payload[3] = (uint8_t)(cmd_ref_year >> 8);
+			payload[4] = (uint8_t)cmd_ref_year;
+			payload[5] = cmd_ref_mon;
+			payload[6] = cmd_ref_day;
+			payload[7] = 1; // to SRAM and flash
+			break;
+		case CMD_LEAP_UPDATE:
+			// This is a set leap-second default message. It will write the given
+			// offset to flash.
+			payload[2] = cmd_leap_offset;
+			payload[3] = 1; // to SRAM and flash
+			break;
+	}
+	tx_send(len);
+}
 
-	if (str_len < 9) return; // No sentence is shorter than $GPGGA*xx
-	// First, check the checksum of the sentence
+// Frame the len byte payload at tx_buf + 4 and start sending it.
+static void tx_send(uint8_t len) {
+	uint8_t *payload = tx_buf + 4;
+	// A0 A1 len-hi len-lo payload... checksum CR LF
 	uint8_t checksum = 0;
-	int i;
-	for(i = 1; i < str_len; i++) {
-		if (rx_buf[i] == '*') break;
-		checksum ^= rx_buf[i];
-	}
-	if (i > str_len - 3) {
-		return; // there has to be room for the "*" and checksum.
-	}
-	i++; // skip the *
-	uint8_t sent_checksum = (hexChar(rx_buf[i]) << 4) | hexChar(rx_buf[i + 1]);
-	if (sent_checksum != checksum) {
-		return; // bad checksum.
-	}
-  
-	const char *ptr = (char *)rx_buf;
-	if (!strncmp_P(ptr, PSTR("$GPRMC"), 6)) {
-		// $GPRMC,172313.000,A,xxxx.xxxx,N,xxxxx.xxxx,W,0.01,180.80,260516,,,D*74\x0d\x0a
-		ptr = skip_commas(ptr, 1);
-		if (ptr == NULL) return; // not enough commas
-		char h = (ptr[0] - '0') * 10 + (ptr[1] - '0');
-		uint8_t min = (ptr[2] - '0') * 10 + (ptr[3] - '0');
-		uint8_t s = (ptr[4] - '0') * 10 + (ptr[5] - '0');
-		ptr = skip_commas(ptr, 1);
-		if (ptr == NULL) return; // not enough commas
-		gps_locked = *ptr == 'A'; // A = AOK
-		ptr = skip_commas(ptr, 7);
-		if (ptr == NULL) return; // not enough commas
-		uint8_t d = (ptr[0] - '0') * 10 + (ptr[1] - '0');
-		uint8_t mon = (ptr[2] - '0') * 10 + (ptr[3] - '0');
-		uint8_t y = (ptr[4] - '0') * 10 + (ptr[5] - '0');
-
-		// We must turn the two digit year into the actual A.D. year number.
-		// As time goes forward, we can keep a record of how far time has gotten,
-		// and assume that time will always go forwards. If we see a date ostensibly
-		// in the past, then it "must" mean that we've actually wrapped and need to
-		// add 100 years. We keep this "reference" date in sync with the GPS receiver,
-		// as it uses the reference date to control the GPS week rollover window.
-  		y += 2000;
-		while (y < utc_ref_year) y += 100; // If it's in the "past," assume time wrapped on us.
-  
-		if (utc_ref_year != 0 && y != utc_ref_year) {
-			// Once a year, we should update the refence date in the receiver. If we're running on New Years,
-			// then that's probably when it will happen, but anytime is really ok. We just don't want to do
-			// it a lot for fear of burning the flash out in the GPS receiver.
-  			updateUTCReference(y, mon, d);
-			utc_ref_year = y;
-			utc_ref_mon = mon;
-			utc_ref_day = d;
-		}
+	for(uint8_t i = 0; i < len; i++) checksum ^= payload[i];
+	tx_buf[0] = 0xa0;
+	tx_buf[1] = 0xa1;
+	tx_buf[2] = 0;
+	tx_buf[3] = len;
+	payload[len] = checksum;
+	payload[len + 1] = 0x0d;
+	payload[len + 2] = 0x0a;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		tx_pos = 0;
+		tx_len = len + 7;
+	}
+	UCSR0B |= _BV(UDRIE0); // enable the TX interrupt. It will trigger right away.
+}
 
-		// The problem is that our D/M/Y is UTC, but DST decisions are made in the local
-		// timezone. We can adjust the day against standard time midnight, and
-		// that will be good enough. Don't worry that this can result in d being either 0
-		// or past the last day of the month. Those will still be more or less than the "decision day"
-		// for DST, which is all that really matters.
-		if (h + tz_hour < 0) d--;
-		if (h + tz_hour > 23) d++;
-		uint8_t dst_flags = calculateDST(d, mon, y);
-		handle_time(h, min, s, dst_flags);
+static void cmd_done(void) {
+	cmd_tries[cmd_current] = 0;
+	cmd_current = CMD_NONE;
+}
+
+// The current command went unanswered or was NACKed. Back off and try
+// again, or give up on it.
+static void cmd_retry(uint32_t now) {
+	if (++cmd_tries[cmd_current] < CMD_TRIES) {
+		cmd_pending |= _BV(cmd_current);
+		cmd_retry_at = now + ((uint32_t)CMD_TIMEOUT << cmd_tries[cmd_current]);
+	} else {
+		STAT_INC(cmd_failures);
+		cmd_tries[cmd_current] = 0;
 	}
+	cmd_current = CMD_NONE;
 }
 
-ISR(USART0_RX_vect) {
-	uint8_t rx_char = UDR0;
- 
-	if (nmea_ready) return; // ignore serial until current buffer handled 
-	if (rx_str_len == 0 && !(rx_char == '$' || rx_char == 0xa0)) return; // wait for a "$" or A0 to start the line.
+// Called from the main loop. Send the next command when the last one is
+// done with, and give up waiting on the last one after CMD_TIMEOUT.
+static void cmd_service(uint32_t now) {
+	if (cmd_current != CMD_NONE) {
+		if ((int32_t)(now - cmd_deadline) >= 0) cmd_retry(now);
+		return;
+	}
+	if (!cmd_pending || tx_pos != tx_len) return;
+	if (cmd_retry_at) {
+		if ((int32_t)(now - cmd_retry_at) < 0) return; // backing off
+		cmd_retry_at = 0;
+	}
+	uint8_t cmd = 0;
+	while (!(cmd_pending & _BV(cmd))) cmd++;
+	cmd_pending &= ~_BV(cmd);
+	cmd_current = cmd;
+	cmd_deadline = now + CMD_TIMEOUT;
+	cmd_send(cmd);
+	trace(TRACE_CMD, cmd);
+}
+
+// Called from the main loop. Start a trace dump if one was asked for, and
+// send the next piece of it whenever the UART is free.
+static void trace_service(void) {
+	if (trace_dump_asked) {
+		trace_dump_asked = 0;
+		if (trace_dump_pos == TRACE_DUMP_END) trace_dump_pos = 0;
+	}
+	if (trace_dump_pos == TRACE_DUMP_END || tx_pos != tx_len) return;
+	// ID, the index of the first event (or TRACE_LEN plus the offset into
+	// the stats) here, how many events there are in all, events or stats...
+	uint8_t *payload = tx_buf + 4;
+	payload[0] = TRACE_MSG_ID;
+	payload[1] = trace_dump_pos;
+	payload[2] = TRACE_LEN;
+	uint8_t len = 3;
+	if (trace_dump_pos >= TRACE_LEN) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			const uint8_t *p = (const uint8_t *)&stats + (trace_dump_pos - TRACE_LEN);
+			for(uint8_t i = 0; i < TRACE_STATS_PER_MSG && trace_dump_pos < TRACE_DUMP_END; i++, trace_dump_pos++)
+				payload[len++] = *p++;
+		}
+		tx_send(len);
+		return;
+	}
+#ifdef WITH_TRACE
+	for(uint8_t i = 0; i < TRACE_PER_MSG && trace_dump_pos < TRACE_LEN; i++) {
+		uint8_t pos = trace_pos + trace_dump_pos++;
+		if (pos >= TRACE_LEN) pos -= TRACE_LEN;
+		const struct trace_ev *ev = &(trace_buf[pos]);
+		payload[len++] = ev->type;
+		payload[len++] = ev->arg;
+		payload[len++] = ev->high;
+		payload[len++] = ev->count >> 8;
+		payload[len++] = ev->count;
+	}
+	tx_send(len);
+#endif
+}
 
-	rx_buf[rx_str_len] = rx_char;
+#ifdef WITH_SYNC
+// Called from the main loop. On the bus master, send the timing frame for
+// the current second as soon as the UART is free, saying how long after the
+// start of the second that was.
+static void sync_service(void) {
+	if (!sync_due || tx_pos != tx_len) return;
+	sync_due = 0;
+	uint32_t count, start;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = timer_count_isr();
+		start = pps_raw;
+	}
+	// A second we made up started on a tick boundary.
+	if (second_synthesized) start = tick_count + ((int32_t)(tick_count_frac - (ticks - second_tick) * tick_len) >> 16);
+	uint32_t since = count - start;
+	if (since >= SYNC_LATE) return;
+	uint8_t *payload = tx_buf + 4;
+	payload[0] = SYNC_MSG_ID;
+	payload[1] = holdover?SYNC_HOLDOVER:SYNC_LOCKED;
+	payload[2] = utc_hour;
+	payload[3] = utc_minute;
+	payload[4] = utc_second;
+	payload[5] = utc_days >> 16;
+	payload[6] = utc_days >> 8;
+	payload[7] = utc_days;
+	payload[8] = since >> 8;
+	payload[9] = since;
+	tx_send(SYNC_LEN);
+}
+#else
+static inline void sync_service(void) { }
+#endif
 
-	if (++rx_str_len == RX_BUF_LEN) {
-		// The string is too long. Start over.
-		rx_str_len = 0;
+// Match an ACK, NACK or answer from the receiver up with the command we're
+// waiting on. Returns whether it's the answer to it.
+static uint8_t cmd_response(const uint8_t *payload) {
+	if (cmd_current == CMD_NONE) return 0;
+	uint8_t answer = pgm_read_byte(&(cmd_defs[cmd_current].answer));
+	if (payload[0] == 0x83 || payload[0] == 0x84) {
+		// ACK or NACK, followed by the ID (and sub-ID) it's for
+		uint8_t id = pgm_read_byte(&(cmd_defs[cmd_current].id));
+		if (payload[1] != id || (id == 0x64 && payload[2] != pgm_read_byte(&(cmd_defs[cmd_current].sub)))) return 0;
+		if (payload[0] == 0x84) {
+			STAT_INC(cmd_nacks);
+			cmd_retry(timer_value());
+			return 0;
+		}
+		// The receiver switches over once it's sent the ACK. What it sends
+		// then comes in at a different time, so learn that over.
+#ifdef WITH_BINARY
+		if (cmd_current == CMD_SERIAL) uart_baud(1);
+		else if (cmd_current == CMD_BINARY) gps_binary = 1;
+		else
+#endif
+		if (cmd_current == CMD_NMEA) gps_rmc_only = 1;
+		if (cmd_current <= CMD_NMEA) rx_phase_rejects = RX_RELEARN;
+		if (answer == 0) cmd_done();
+		return 0;
 	}
+	if (answer == 0 || payload[0] != 0x64 || payload[1] != answer) return 0;
+	cmd_done();
+	return 1;
+}
 
-	// If it's an ASCII message, then it's ended with a CRLF.
-	// If it's a binary message, then it's ended when it's the correct length
-	if ( (rx_buf[0] == '$' && (rx_char == 0x0d || rx_char == 0x0a)) ||
-		(rx_buf[0] == 0xa0 && rx_str_len >= 4 && rx_str_len >= ((rx_buf[2] << 8) + rx_buf[3] + 7)) ) {
-		rx_buf[rx_str_len] = 0; // null terminate
-		nmea_ready = 1; // Mark it as ready
+// Start (or start over) switching the receiver to the mode in EEPROM. If
+// it doesn't ACK, it's still sending all of its NMEA at 9600 baud, and
+// that's fine.
+static void gps_configure(void) {
+	uart_baud(0);
+	gps_rmc_only = 0;
+	gps_chatty = 0;
+#ifdef WITH_BINARY
+	gps_binary = 0;
+	gps_quiet = 0;
+	if (gps_mode != GPS_NMEA) {
+		if (gps_mode == GPS_BINARY_FAST) cmd_post(CMD_SERIAL);
+		cmd_post(CMD_BINARY);
+		cmd_post(CMD_LEAP_CHECK); // we need GPS - UTC
 		return;
 	}
+#endif
+	cmd_post(CMD_NMEA);
+}
+
+static void set_locked(uint8_t locked) {
+	if (locked != gps_locked) trace(TRACE_LOCK, locked);
+	gps_locked = locked;
+}
+
+#if defined(WITH_BINARY) || defined(WITH_SYNC)
+// The inverse of days_since_2000()
+static void date_from_days(uint32_t days, uint16_t *y, uint8_t *mon, uint8_t *d) {
+	uint16_t year = 2000;
+	while (days >= 365U + is_leap(year)) days -= 365 + is_leap(year++);
+	uint8_t m = 12;
+	uint16_t before;
+	while (days < (before = pgm_read_word(&(days_before_month[m - 1])) + (m > 2 && is_leap(year)))) m--;
+	*y = year;
+	*mon = m;
+	*d = days - before + 1;
+}
+#endif
+
+#ifdef WITH_SYNC
+// A timing frame from the bus master, which came in early in the second
+// it's about. Without a fix of our own, it marks the start of the second in
+// place of the PPS.
+static void handle_sync(const uint8_t *payload) {
+	if (sync_role != SYNC_FOLLOWER || gps_locked) return;
+	uint32_t edge;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		edge = sync_rx_count;
+	}
+	edge -= ((payload[8] << 8) | payload[9]) + sync_delay + (uart_fast?SYNC_BYTE_FAST:SYNC_BYTE);
+	sync_hour = payload[2];
+	sync_minute = payload[3];
+	sync_second = payload[4];
+	sync_days = ((uint32_t)payload[5] << 16) | ((uint32_t)payload[6] << 8) | payload[7];
+	sync_fresh = 1;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		pps_raw = edge;
+		new_second = 1;
+	}
+	trace(TRACE_SYNC, payload[1]);
+}
+
+// Take the time from the last timing frame, for the second it marked.
+static void sync_apply(void) {
+	if (sync_days != utc_days || utc_day == 0) {
+		uint16_t y;
+		uint8_t mon;
+		date_from_days(sync_days, &y, &mon, &utc_day);
+		utc_days = sync_days;
+		utc_day_start = utc_days * 1440UL;
+		utc_year = y;
+		tz_next_change = 0;
+	}
+	utc_hour = sync_hour;
+	utc_minute = sync_minute;
+	utc_second = sync_second;
+	set_local_time();
+	time_set = 1;
+	time_fresh = 1;
+}
+#else
+static inline void handle_sync(const uint8_t *payload) { }
+static inline void sync_apply(void) { }
+#endif
+
+// Check when a time label came in against the phase we've learned, and
+// learn from it. Returns 0 if it should be ignored.
+static uint8_t rx_phase_check(uint16_t age) {
+	if (age >= COUNT_MS(1000) + RX_SLACK) return 1; // no PPS to go by
+	int32_t off = (int32_t)age - rx_phase;
+	if (time_set && rx_phase_rejects < RX_RELEARN) {
+		if (off > (int32_t)RX_SLACK || off < -(int32_t)RX_SLACK) {
+			rx_phase_rejects++;
+			STAT_INC(rx_late);
+			trace(TRACE_LATE, age >> 8);
+			return 0;
+		}
+		rx_phase += off >> 2;
+	} else {
+		rx_phase = age;
+	}
+	rx_phase_rejects = 0;
+	rx_ahead = rx_phase >= RX_AHEAD;
+	return 1;
+}
 
+// How many seconds a time label is ahead of our own count, within half a day
+static int32_t label_offset(int8_t h, uint8_t min, uint8_t s) {
+	int32_t off = ((int32_t)(h - utc_hour) * 60 + (int8_t)(min - utc_minute)) * 60 + (int8_t)(s - utc_second);
+	if (off > 43200L) off -= 86400L;
+	if (off <= -43200L) off += 86400L;
+	return off;
 }
 
-ISR(USART0_UDRE_vect) {
-	if (tx_buf_head == tx_buf_tail) {
-		// the transmit queue is empty.
-		UCSR0B &= ~_BV(UDRIE0); // disable the TX interrupt
+static void gps_time(int8_t h, uint8_t min, uint8_t s, uint8_t d, uint8_t mon, uint16_t y, uint16_t age) {
+	if (utc_ref_year != 0 && y != utc_ref_year) {
+		// Once a year, we should update the refence date in the receiver. If we're running on New Years,
+		// then that's probably when it will happen, but anytime is really ok. We just don't want to do
+		// it a lot for fear of burning the flash out in the GPS receiver.
+		cmd_ref_year = y;
+		cmd_ref_mon = mon;
+		cmd_ref_day = d;
+		cmd_post(CMD_UTC_REF_UPDATE);
+		utc_ref_year = y;
+		utc_ref_mon = mon;
+		utc_ref_day = d;
+	}
+
+	if (!rx_phase_check(age)) return;
+
+	// It ought to be the second we're in (or the next, if it's ahead). If
+	// we're counting them ourselves, that's all we wanted to know - unless
+	// it's a new day, and we need the date.
+	uint8_t agree = time_set && label_offset(h, min, s) == rx_ahead;
+	if (pps_counting) {
+		STAT_INC(pps_checks);
+		if (agree) {
+			rx_mismatched = 0;
+			if (d == utc_day) return;
+		} else if (!rx_mismatched) {
+			rx_mismatched = 1;
+			STAT_INC(rx_mismatches);
+			return;
+		} else {
+			rx_mismatched = 0;
+			STAT_INC(pps_check_fails);
+			pps_counting = 0;
+			trace(TRACE_COUNTING, 0);
+		}
+	}
+	if (!agree) pps_agreed = 0;
+	else if (pps_agreed < PPS_AGREE) pps_agreed++;
+
+	handle_time(h, min, s, d, mon, y);
+}
+
+#ifdef WITH_BINARY
+// The navigation data message has GPS time: weeks since 6 Jan 1980 and
+// hundredths of a second into the week. That's ahead of UTC by the leap
+// seconds.
+static void handle_nav(const struct gps_msg *msg) {
+	set_locked(msg->nav.fix != 0);
+	if (!gps_locked || gps_leap == 0xff || !gps_time_wanted) return;
+	uint32_t tow = msg->nav.tow / 100;
+	if (tow * 100 != msg->nav.tow) return; // between seconds, from a 10 Hz receiver
+
+	int32_t s = tow - gps_leap;
+	uint32_t days = msg->nav.week * 7UL;
+	if (s < 0) {
+		s += 7 * 86400L;
+		days -= 7;
+	}
+	days += s / 86400;
+	s %= 86400;
+	// The week number might have rolled over (every 1024 weeks), or might
+	// only be ten bits to begin with. Time only goes forward from the
+	// reference date. 2000 is 7300 days after 1980.
+	uint32_t earliest = 7300;
+	if (utc_ref_year != 0) earliest += days_since_2000(utc_ref_year, utc_ref_mon, utc_ref_day);
+	while (days < earliest) days += 1024 * 7;
+
+	uint16_t y;
+	uint8_t mon, d;
+	date_from_days(days - 7300, &y, &mon, &d);
+	gps_time(s / 3600, (s / 60) % 60, s % 60, d, mon, y, msg->age);
+}
+#endif
+
+static inline void handleGPS(const struct gps_msg *msg) {
+	if (msg->type == MSG_SYNC) {
+		handle_sync(msg->payload);
+		return;
+	}
+#ifdef WITH_BINARY
+	// Once it's in binary mode, NMEA means the receiver has been reset.
+	if (msg->type != MSG_RMC || !gps_binary) gps_quiet = 0;
+	if (msg->type == MSG_NAV) {
+		handle_nav(msg);
+		return;
+	}
+#endif
+	if (msg->type == MSG_BINARY) { // binary protocol message
+		const uint8_t *payload = msg->payload;
+		if (!cmd_response(payload)) {
+			if (payload[0] == 0x64) STAT_INC(cmd_unsolicited);
+			return;
+		}
+		if (payload[1] == 0x8a) {
+			utc_ref_year = (payload[3] << 8) | payload[4];
+			utc_ref_mon = payload[5];
+			utc_ref_day = payload[6];
+		} else if (payload[1] == 0x8e) {
+			if (!(payload[14] & (1 << 2))) return; // GPS leap seconds invalid
+			gps_leap = payload[13];
+			if (payload[12] == payload[13]) return; // Current and default agree
+			cmd_leap_offset = payload[13];
+			cmd_post(CMD_LEAP_UPDATE);
+		}
 		return;
 	}
-	UDR0 = tx_buf[tx_buf_tail];
-	if (++tx_buf_tail == TX_BUF_LEN) tx_buf_tail = 0; // point to the next char
+
+	// $GPRMC,172313.000,A,xxxx.xxxx,N,xxxxx.xxxx,W,0.01,180.80,260516,,,D*74\x0d\x0a
+	set_locked(msg->rmc.status == 'A'); // A = AOK
+	if (!gps_locked || msg->rmc.h == RMC_NO_TIME) return;
+
+	int8_t h = msg->rmc.h;
+	uint8_t min = msg->rmc.min;
+	uint8_t s = msg->rmc.s;
+	uint8_t d = msg->rmc.d;
+	uint8_t mon = msg->rmc.mon;
+	uint16_t y = msg->rmc.y;
+
+	// We must turn the two digit year into the actual A.D. year number.
+	// As time goes forward, we can keep a record of how far time has gotten,
+	// and assume that time will always go forwards. If we see a date ostensibly
+	// in the past, then it "must" mean that we've actually wrapped and need to
+	// add 100 years. We keep this "reference" date in sync with the GPS receiver,
+	// as it uses the reference date to control the GPS week rollover window.
+	y += 2000;
+	while (y < utc_ref_year) y += 100; // If it's in the "past," assume time wrapped on us.
+
+	gps_time(h, min, s, d, mon, y, msg->age);
 }
 
-// If the TX buffer fills up, then this method will block, which should be avoided.
-static inline void tx_char(const uint8_t c) {
-	int buf_in_use;
-	do {
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-			buf_in_use = tx_buf_head - tx_buf_tail;
+// Receive state machine
+#define RX_IDLE 0 // waiting for a $ or A0 to start a message
+#define RX_NMEA 1 // in a sentence, before the *
+#define RX_NMEA_CKSUM 2 // reading the two checksum digits after the *
+#define RX_NMEA_END 3 // waiting for the CR or LF
+#define RX_BIN 4 // in a binary message
+
+// The only sentence we want. Multi-constellation receivers send it as
+// GNRMC rather than GPRMC.
+const char PROGMEM rmc_sentence[] = "GPRMC";
+#define RMC_TALKER_ALT 'N' // instead of the P
+
+// RMC fields
+#define RMC_TIME 1
+#define RMC_STATUS 2
+#define RMC_DATE 9
+
+// How long since the last PPS edge, for a message that's just come in
+static inline uint16_t rx_age_isr(void) __attribute__ ((always_inline));
+static inline uint16_t rx_age_isr(void) {
+	uint32_t age = timer_count_isr() - pps_raw;
+	return (age > 0xffff)?0xffff:age;
+}
+
+static inline uint8_t hex_value(uint8_t c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	c |= 0x20; // make lower case
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return 0xff;
+}
+
+ISR(USART0_RX_vect) {
+	static uint8_t state = RX_IDLE;
+	static uint8_t pos; // bytes since the start of the message (or the *)
+	static uint16_t bin_len; // binary payload length
+#if defined(WITH_BINARY) || defined(WITH_SYNC)
+	static uint8_t bin_id; // binary message ID
+#endif
+	static uint8_t checksum, field, field_pos, digits;
+	static uint8_t between; // a time label with tenths (or less) of a second
+	static uint8_t time_wanted; // gps_time_wanted when the RMC started
+#ifdef WITH_SYNC
+	static uint32_t start; // when the first byte came in
+#endif
+
+	uint8_t rx_char = UDR0;
+	volatile struct gps_msg *msg = &(rx_msg[rx_slot]);
+	uint8_t ev = 0, ev_arg = 0; // to trace on the way out
+
+	// A "$" can't be inside a sentence, so it starts the next one wherever we were.
+	if (state == RX_IDLE || (rx_char == '$' && state != RX_BIN)) {
+		if (rx_char == TRACE_DUMP_BYTE) trace_dump_asked = 1;
+		if (!(rx_char == '$' || rx_char == 0xa0)) return; // wait for a "$" or A0 to start the line.
+		if (msg->type != MSG_NONE) {
+			// The main loop hasn't gotten to this slot yet. We have to drop this one.
+			stats.rx_overruns++;
+			trace_isr(TRACE_DROP, 0);
+			return;
 		}
-		if (buf_in_use < 0) buf_in_use += TX_BUF_LEN;
-		wdt_reset(); // we might be waiting a while.
-	} while (buf_in_use >= TX_BUF_LEN - 2) ; // wait for room in the transmit buffer
+		state = (rx_char == '$')?RX_NMEA:RX_BIN;
+#ifdef WITH_SYNC
+		if (state == RX_BIN) start = timer_count_isr();
+#endif
+		pos = 0;
+		checksum = 0;
+		field = 0;
+		field_pos = 0;
+		digits = 0;
+		between = 0;
+		msg->rmc.h = msg->rmc.min = msg->rmc.s = 0;
+		msg->rmc.d = msg->rmc.mon = msg->rmc.y = 0;
+		msg->rmc.status = 'V';
+		return;
+	}
 
-	tx_buf[tx_buf_head] = c;
+	pos++;
+	switch(state) {
+		case RX_NMEA:
+			if (rx_char == '*') {
+				state = RX_NMEA_CKSUM;
+				pos = 0;
+				break;
+			}
+			if (rx_char < 0x20) { // a new line before the checksum
+				state = RX_IDLE;
+				break;
+			}
+			checksum ^= rx_char;
+			if (pos <= sizeof(rmc_sentence) - 1) {
+				// Give up as soon as we know it's not the sentence we want
+				if (rx_char != pgm_read_byte(&(rmc_sentence[pos - 1])) && !(pos == 2 && rx_char == RMC_TALKER_ALT)) {
+					state = RX_IDLE;
+					if (rx_ignored != 0xff) rx_ignored++;
+				} else if (pos == sizeof(rmc_sentence) - 1) {
+					time_wanted = gps_time_wanted;
+				}
+				break;
+			}
+			if (rx_char == ',') {
+				field++;
+				field_pos = 0;
+				break;
+			}
+			if (field == RMC_STATUS) {
+				if (field_pos == 0) msg->rmc.status = rx_char;
+			} else if ((field == RMC_TIME || field == RMC_DATE) && field_pos < 6) {
+				if (!time_wanted) {
+					// We're counting from the PPS, and only want the status.
+				} else if (rx_char < '0' || rx_char > '9') {
+					digits = 0x80; // poisoned
+					break;
+				} else {
+					// Each pair of digits is one value - h, min, s or d, mon, y
+					volatile uint8_t *val = (field == RMC_TIME)?&(msg->rmc.h):&(msg->rmc.d);
+					val += field_pos >> 1;
+					*val = *val * 10 + (rx_char - '0');
+					digits++;
+				}
+			} else if (field == RMC_TIME && rx_char > '0' && rx_char <= '9') {
+				between = 1; // after the decimal point
+			}
+			field_pos++;
+			break;
+		case RX_NMEA_CKSUM:
+			{
+				uint8_t v = hex_value(rx_char);
+				if (v == 0xff) {
+					state = RX_IDLE;
+					break;
+				}
+				checksum ^= v << ((pos == 1)?4:0); // it comes out 0 if they match
+				if (pos == 2) state = RX_NMEA_END;
+			}
+			break;
+		case RX_NMEA_END:
+			state = RX_IDLE;
+			if (!(rx_char == 0x0d || rx_char == 0x0a)) break;
+			if (checksum != 0) {
+				stats.rx_checksum_errors++;
+				ev = TRACE_CKSUM;
+				break;
+			}
+			if (between) break; // a 10 Hz receiver's, between seconds
+			if (!time_wanted) msg->rmc.h = RMC_NO_TIME;
+			else if (digits != 12) msg->rmc.status = 'V'; // we didn't get a complete time and date
+			msg->age = rx_age_isr();
+			msg->type = MSG_RMC; // Hand it to the main loop
+			ev = TRACE_RX;
+			ev_arg = MSG_RMC;
+			if (++rx_slot == RX_SLOTS) rx_slot = 0; // and move on to the next slot
+			break;
+		case RX_BIN:
+			// A0 A1 len-hi len-lo payload... checksum CR LF
+			if (pos == 1) {
+				if (rx_char != 0xa1) state = RX_IDLE;
+			} else if (pos == 2) {
+				bin_len = rx_char << 8;
+			} else if (pos == 3) {
+				bin_len |= rx_char;
+				if (bin_len == 0) state = RX_IDLE;
+			} else if (pos < 4 + bin_len) {
+				uint8_t i = pos - 4;
+				if (i == 0) {
+#if defined(WITH_BINARY) || defined(WITH_SYNC)
+					bin_id = rx_char;
+#endif
+					if (rx_char == 0x64 || rx_char == 0x83 || rx_char == 0x84) {
+						if (bin_len > BIN_PAYLOAD_LEN) {
+							stats.rx_overflows++;
+							state = RX_IDLE;
+							ev = TRACE_DROP;
+							ev_arg = 1;
+							break;
+						}
+#ifdef WITH_BINARY
+					} else if (bin_id == NAV_ID) {
+						if (bin_len != NAV_LEN) {
+							state = RX_IDLE;
+							break;
+						}
+						msg->nav.week = 0;
+						msg->nav.tow = 0;
+#endif
+#ifdef WITH_SYNC
+					} else if (bin_id == SYNC_MSG_ID) {
+						if (bin_len != SYNC_LEN) {
+							state = RX_IDLE;
+							break;
+						}
+#endif
+					} else {
+						state = RX_IDLE; // we only care about 0x64 messages, ACK/NACK, nav data and timing frames
+						break;
+					}
+				}
+				checksum ^= rx_char;
+#ifdef WITH_BINARY
+				if (bin_id != NAV_ID) {
+					msg->payload[i] = rx_char;
+				} else if (i == NAV_FIX) {
+					msg->nav.fix = rx_char;
+				} else if (i >= NAV_WEEK && i < NAV_WEEK + 2) { // big endian
+					msg->nav.week = (msg->nav.week << 8) | rx_char;
+				} else if (i >= NAV_TOW && i < NAV_TOW + 4) {
+					msg->nav.tow = (msg->nav.tow << 8) | rx_char;
+				}
+#else
+				msg->payload[i] = rx_char;
+#endif
+			} else {
+				// The checksum byte. We don't need to wait for the CR LF.
+				state = RX_IDLE;
+				if (rx_char != checksum) {
+					stats.rx_checksum_errors++;
+					ev = TRACE_CKSUM;
+					break;
+				}
+				// Hand it to the main loop
+#ifdef WITH_SYNC
+				if (bin_id == SYNC_MSG_ID) {
+					msg->type = MSG_SYNC;
+					sync_rx_count = start;
+				} else
+#endif
+				{
+					msg->age = rx_age_isr();
+#ifdef WITH_BINARY
+					if (bin_id == NAV_ID) msg->type = MSG_NAV;
+					else
+#endif
+					msg->type = MSG_BINARY;
+				}
+				ev = TRACE_RX;
+				ev_arg = msg->type;
+				if (++rx_slot == RX_SLOTS) rx_slot = 0; // and move on to the next slot
+			}
+			break;
+	}
+	if (ev) trace_isr(ev, ev_arg);
+}
+
+ISR(USART0_UDRE_vect) {
+	UDR0 = tx_buf[tx_pos];
+	if (++tx_pos == tx_len) UCSR0B &= ~_BV(UDRIE0); // that was the last one
+}
+
+// Bring ticks up to date with the timer, and return it. Only the main loop
+// does this, and it's never asleep for long, so the count is never more
+// than a few thousand past tick_count.
+static uint32_t timer_value(void) {
+	uint32_t count;
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		// this needs to be atomic, because an intermediate state is tx_buf_head
-		// pointing *beyond* the end of the buffer.
-		if (++tx_buf_head == TX_BUF_LEN) tx_buf_head = 0; // point to the next free spot in the tx buffer
+		count = timer_count_isr();
 	}
-	UCSR0B |= _BV(UDRIE0); // enable the TX interrupt. If it was disabled, then it will trigger one now.
+	// How far into the current tick, in 1/65536ths of a count
+	uint32_t into = ((count - tick_count) << 16) - tick_count_frac;
+	uint16_t n = 0;
+	uint32_t adv = 0;
+	// Usually it's a tick or two, so just step. After a sleep, estimate
+	// with the reciprocal - which can only come up short - first.
+	if (into >= 8 * tick_len) {
+		n = ((into >> 16) * tick_recip) >> 16;
+		adv = n * tick_len;
+	}
+	while (into - adv >= tick_len) {
+		n++;
+		adv += tick_len;
+	}
+	uint32_t frac = tick_count_frac + (adv & 0xffff);
+	tick_count += (adv >> 16) + (frac >> 16);
+	tick_count_frac = frac;
+	// ticks is not allowed to equal zero
+	if ((ticks += n) == 0) ticks++;
+	return ticks;
 }
 
-static inline uint32_t timer_value() __attribute__ ((always_inline));
-static inline uint32_t timer_value() {
-	uint32_t now;
+// The (bottom 16 bits of the) timer count just after the given tick starts.
+// It has to be no more than TICK_WAKE_MAX after the current one.
+static uint16_t tick_to_count(uint32_t when) {
+	uint32_t adv = (when - ticks) * tick_len + tick_count_frac;
+	return tick_count + (adv >> 16) + 1;
+}
+
+// Work out which tick boundary the last PPS edge was nearest, and how far
+// from it. It was no more than a few ticks before (or after) the current
+// one. An edge just before a boundary is that tick's, or a second that
+// starts from it would start a whole tick early.
+static void pps_place(void) {
+	uint32_t raw;
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		now = ticks;
+		raw = pps_raw;
+	}
+	int32_t into = ((int32_t)(raw - tick_count) << 16) - tick_count_frac;
+	uint32_t t = ticks;
+	while (into < 0) {
+		into += tick_len;
+		t--;
+	}
+	while (into > (int32_t)(tick_len >> 1)) {
+		into -= tick_len;
+		t++;
 	}
-	return now;
+	pps_ticks = t;
+	pps_into = into >> 8;
 }
 
-ISR(TIMER2_COMPA_vect) {
-	static uint8_t tick_cycle_pos = 0;
-	if (++tick_cycle_pos >= TICK_CYCLE_LENGTH) tick_cycle_pos = 0;
-	if (tick_cycle_pos >= TICK_NUM_LONG)
-		OCR2A = TICK_BASE_CYCLE - 1; // the OCR register is 1 based - we want a *short* cycle
-	else
-		OCR2A = TICK_BASE_CYCLE; // a long cycle
+ISR(TIMER2_OVF_vect) {
+	timer_high++;
+}
+
+// The main loop's deadline. Waking it up is all there is to do.
+EMPTY_INTERRUPT(TIMER2_COMPB_vect);
+
+// Turn off any solenoids whose pulse is over, and set compare A for the
+// next one that will be. With interrupts off.
+static inline void solenoid_schedule(void) __attribute__ ((always_inline));
+static inline void solenoid_schedule(void) {
+	while(1) {
+		uint16_t now = TCNT2;
+		uint8_t off = 0;
+		int16_t next = INT16_MAX;
+		for(uint8_t i = 0; i < CHANNELS; i++) {
+			if (!(solenoids_on & _BV(i))) continue;
+			int16_t left = solenoid_off[i] - now;
+			if (left <= 0) off |= _BV(i);
+			else if (left < next) next = left;
+		}
+		if (off) {
+			PORTA &= ~chord_porta(off);
+			PORTB &= ~chord_portb(off);
+			solenoids_on &= ~off;
+			trace_isr(TRACE_NOTE_OFF, off);
+		}
+		if (!solenoids_on) {
+			TIMSK2 &= ~_BV(OCIE2A);
+			return;
+		}
+		uint16_t at = now + next;
+		OCR2A = at;
+		TIMSK2 |= _BV(OCIE2A);
+		// If the timer got there while we were at it, the match was missed.
+		if ((int16_t)(at - TCNT2) > 0) return;
+	}
+}
 
-	// ticks is nor allowed to equal zero
-	if (++ticks == 0) ticks++;
+ISR(TIMER2_COMPA_vect) {
+	solenoid_schedule();
 }
 
 ISR(PCINT0_vect) {
 	if (!(PINA & _BV(7))) return; // ignore the trailing edge
+#ifdef WITH_SYNC
+	// Following the bus, the timing frames mark the seconds until our own
+	// receiver has a fix, even if it sends a PPS without one.
+	if (sync_role == SYNC_FOLLOWER && !gps_locked) return;
+#endif
 
-	// we just need to know when the second starts in the outer loop
+	pps_raw = timer_count_isr();
+	trace_isr(TRACE_PPS, 0);
+
+	// the outer loop does the rest
 	new_second = 1;
 }
 
-// pins 0-3 are the 4 quarters notes, low to high. pin 4 is the hourly chime.
-void write_pin(uint8_t pin, uint8_t val) {
-  if (val) {
-    switch(pin) {
-      case 0:
-        PORTA |= _BV(0); break;
-      case 1:
-        PORTA |= _BV(3); break;
-      case 2:
-        PORTB |= _BV(0); break;
-      case 3:
-        PORTB |= _BV(1); break;
-      case 4:
-        PORTB |= _BV(2); break;
-    }
-  } else {
-    switch(pin) {
-      case 0:
-        PORTA &= ~_BV(0); break;
-      case 1:
-        PORTA &= ~_BV(3); break;
-      case 2:
-        PORTB &= ~_BV(0); break;
-      case 3:
-        PORTB &= ~_BV(1); break;
-      case 4:
-        PORTB &= ~_BV(2); break;
-    }
-  }
-}
-
-void do_chime(uint8_t note) {
-	write_pin(note, 1); // turn solenoid on
-	for(uint32_t now = timer_value(); timer_value() - now < SOLENOID_ON; );
-	write_pin(note, 0); // turn solenoid off
-}
-
-// westminster quarters.
-// These should be an even number of seconds long (padding with rests where necessary
-// if BEAT_TIME is a fraction of a second).
-const uint8_t PROGMEM first_song[] = { 3, 2, 1, 0 };
-const uint8_t PROGMEM second_song[] = { 1, 3, 2, 0, 0xff, 1, 2, 3, 1 };
-const uint8_t PROGMEM third_song[] = { 3, 1, 2, 0, 0xff, 0, 2, 3, 1, 0xff, 3, 2, 1, 0 };
-const uint8_t PROGMEM hour_song[] = { 1, 3, 2, 0, 0xff, 1, 2, 3, 1, 0xff, 3, 1, 2, 0, 0xff, 0, 2, 3, 1, 0xff, 0xff, 0xff };
+// Called once per PPS, after pps_place(). Count how many timer counts there
+// were in the last second and steer the tick length to make that 1000
+// ticks. Then add a little to (or take a little from) the next second to
+// pull the tick boundaries into line with the PPS edge.
+static void pps_discipline(void) {
+	static uint32_t last_ticks, last_raw;
+	uint32_t raw;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		raw = pps_raw;
+	}
+
+	uint32_t elapsed = pps_ticks - last_ticks;
+	// Anything too far from a second is a missed or spurious edge.
+	if (last_ticks != 0 && elapsed > 970 && elapsed < 1030) {
+		uint32_t measured = ((raw - last_raw) << 16) / 1000;
+		tick_rate += ((int32_t)(measured - tick_rate)) >> TICK_RATE_GAIN;
+	}
+	last_ticks = pps_ticks;
+	last_raw = raw;
+
+	// The phase error, in 1/256ths of a count (1/8 us)
+	int16_t phase = pps_into;
+	stats.pps_phase_us = phase / 8;
+	stats.osc_ppm = ((int32_t)(tick_rate - TICK_NOMINAL) * 125) >> 8;
+
+	// Correcting half the phase error over the next second is (about)
+	// 32/65536ths of a count per tick, per count of error.
+	tick_len = tick_rate + phase / 8;
+	tick_recip = 0xffffffffUL / tick_len;
+}
+
+#ifdef WITH_SYNTH
+// One bell tone, as two cycles of the note: its hum (an octave down) at
+// 0.4, the note at 1, the quint at 0.3, the nominal (an octave up) at 0.6
+// and the fifth above that at 0.15. A real bell's tierce is a minor
+// third, which doesn't fit in a whole number of cycles, so it's left out.
+// The second table is the first 3 dB down.
+const int8_t PROGMEM synth_wave[2][64] = {
+	{ 0, 42, 79, 107, 123, 127, 121, 107, 90, 72, 56, 42, 31, 23, 16, 11,
+	  7, 4, 3, 3, 3, 1, -3, -12, -24, -38, -52, -62, -66, -61, -47, -25,
+	  0, 25, 47, 61, 66, 62, 52, 38, 24, 12, 3, -1, -3, -3, -3, -4,
+	  -7, -11, -16, -23, -31, -42, -56, -72, -90, -107, -121, -127, -123, -107, -79, -42 },
+	{ 0, 30, 56, 76, 87, 90, 85, 76, 63, 51, 39, 30, 22, 16, 11, 8,
+	  5, 3, 2, 2, 2, 1, -2, -8, -17, -27, -37, -44, -46, -43, -33, -18,
+	  0, 18, 33, 43, 46, 44, 37, 27, 17, 8, 2, -1, -2, -2, -2, -3,
+	  -5, -8, -11, -16, -22, -30, -39, -51, -63, -76, -85, -90, -87, -76, -56, -30 },
+};
+
+// Westminster in E: B3, E4, F#4 and G#4 for the quarters, and E3 for the hour.
+const uint16_t PROGMEM synth_steps[CHANNELS] = {
+	SYNTH_STEP(246.94), SYNTH_STEP(329.63), SYNTH_STEP(369.99), SYNTH_STEP(415.30), SYNTH_STEP(164.81)
+};
+
+static inline void synth_level(struct synth_voice *v, uint8_t atten) {
+	v->atten = atten;
+	v->wave = (atten & 1)?synth_wave[1]:synth_wave[0];
+	v->shift = atten >> 1;
+}
+
+ISR(TIMER0_COMPA_vect) {
+	// The songs' steps are 650 ms apart at the least, so no more than three
+	// voices sound at once. Even so, this is most of the time between
+	// samples, so it's kept to what changes every sample.
+	struct synth_voice *v = synth_voices;
+	uint8_t sounding = 0;
+	int16_t mix = 0;
+	for(uint8_t i = CHANNELS; i; i--, v++) {
+		if (v->atten >= SYNTH_SILENT) continue;
+		sounding = 1;
+		uint16_t phase = v->phase += v->step;
+		int8_t level = pgm_read_byte(v->wave + (phase >> 10));
+		// A shift by a variable is a loop. Jump into a run of them instead.
+		switch (v->shift) {
+			case 6: level >>= 1; // fall through
+			case 5: level >>= 1; // fall through
+			case 4: level >>= 1; // fall through
+			case 3: level >>= 1; // fall through
+			case 2: level >>= 1; // fall through
+			case 1: level >>= 1;
+		}
+		mix += level;
+	}
+	// One voice a sample dies away a step, each once every SYNTH_DECAY.
+	if (++synth_env == SYNTH_DECAY) synth_env = 0;
+	if (synth_env < CHANNELS) {
+		v = synth_voices + synth_env;
+		if (v->atten < SYNTH_SILENT) synth_level(v, v->atten + 1);
+	}
+	mix >>= 1;
+	if (mix > 127) mix = 127;
+	if (mix < -128) mix = -128;
+	OCR1A = SYNTH_MID + mix;
+	if (!sounding) TIMSK0 = 0;
+}
+
+static void synth_init(void) {
+	PRR &= ~(_BV(PRTIM0) | _BV(PRTIM1));
+	PUEA &= ~_BV(5);
+	DDRA |= _BV(5);
+	TOCPMSA1 = _BV(TOCC4S0); // OC1A on TOCC4 (PA5)
+	TOCPMCOE = _BV(TOCC4OE);
+	OCR1A = SYNTH_MID;
+	TCCR1A = _BV(COM1A1) | _BV(WGM10); // fast PWM, 8 bit
+	TCCR1B = _BV(WGM12) | _BV(CS10); // no prescaling
+	OCR0A = SYNTH_TOP;
+	TCCR0A = _BV(WGM01); // CTC
+	TCCR0B = _BV(CS01); // prescale by 8
+	TIMSK0 = 0; // until something's struck
+	synth_env = 0;
+	for(uint8_t i = 0; i < CHANNELS; i++) {
+		synth_voices[i].step = pgm_read_word(&(synth_steps[i]));
+		synth_level(&(synth_voices[i]), SYNTH_SILENT);
+	}
+}
+
+// Start the chord's voices with the next sample, which is made to come a
+// whole sample from now, so every note sounds the same 125 us after its
+// strike.
+static void synth_strike(uint8_t chord) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		TCNT0 = 0;
+		TIFR0 = _BV(OCF0A);
+		TIMSK0 = _BV(OCIE0A);
+		for(uint8_t i = 0; i < CHANNELS; i++) {
+			if (!(chord & _BV(i))) continue;
+			synth_voices[i].phase = 0;
+			synth_level(&(synth_voices[i]), 0);
+		}
+	}
+}
+#endif
+
+// Strike all of the channels in the chord (a bitmask of channels) at once.
+// This returns immediately - compare A turns each solenoid off again once
+// its pulse is done.
+void do_chord(uint8_t chord) {
+#ifdef WITH_SYNTH
+	if (chime_synth) {
+		synth_strike(chord);
+		trace(TRACE_NOTE_ON, chord);
+		return;
+	}
+#endif
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		PORTA |= chord_porta(chord);
+		PORTB |= chord_portb(chord);
+		uint16_t now = TCNT2;
+		for(uint8_t i = 0; i < CHANNELS; i++) {
+			if (chord & _BV(i)) solenoid_off[i] = now + ((chime_cal[i].pulse * tick_len) >> 16);
+		}
+		solenoids_on |= chord;
+		solenoid_schedule();
+	}
+	trace(TRACE_NOTE_ON, chord);
+}
+
+// Unset (0xff) calibration means no lead and the standard pulse. Synthesized
+// bells have no lead.
+static void chime_cal_load(void) {
+	eeprom_read_block(chime_cal, EE_CHIME_CAL, sizeof(chime_cal));
+	uint8_t lead_max = 0;
+	for(uint8_t i = 0; i < CHANNELS; i++) {
+		if (chime_cal[i].lead == 0xff || chime_synth) chime_cal[i].lead = 0;
+		if (chime_cal[i].pulse == 0xff || chime_cal[i].pulse == 0) chime_cal[i].pulse = SOLENOID_ON;
+		if (chime_cal[i].lead > lead_max) lead_max = chime_cal[i].lead;
+	}
+	chime_ahead = lead_max + CHIME_SETUP;
+}
+
+static void event_add(uint32_t when, uint8_t type, uint8_t arg) {
+	if (events_len == EVENTS) {
+		STAT_INC(event_overflows);
+		return;
+	}
+	uint8_t i = events_len++;
+	for(; i > 0 && (int32_t)(when - events[i - 1].when) < 0; i--) events[i] = events[i - 1];
+	events[i].when = when;
+	events[i].type = type;
+	events[i].arg = arg;
+}
+
+static void event_remove(uint8_t i) {
+	events_len--;
+	for(; i < events_len; i++) events[i] = events[i + 1];
+}
+
+static uint8_t event_queued(uint8_t type) {
+	for(uint8_t i = 0; i < events_len; i++) {
+		if (events[i].type == type) return 1;
+	}
+	return 0;
+}
+
+// Arrange for the chord to sound at the given tick. Each channel is
+// energized early by its own lead time. This has to be called at least
+// chime_ahead ticks ahead of time.
+static void strike_at(uint8_t chord, uint32_t when) {
+	for(uint8_t i = 0; i < events_len; i++) {
+		if (events[i].type != EVENT_STRIKE || !(events[i].arg & chord)) continue;
+		// A channel that's still waiting from before goes now.
+		do_chord(events[i].arg & chord);
+		if (!(events[i].arg &= ~chord)) event_remove(i--);
+	}
+	for(uint8_t i = 0; i < CHANNELS; i++) {
+		if (!(chord & _BV(i))) continue;
+		uint32_t at = when - chime_cal[i].lead;
+		// Channels with the same lead make one chord.
+		uint8_t e = 0;
+		while (e < events_len && !(events[e].type == EVENT_STRIKE && events[e].when == at)) e++;
+		if (e < events_len) events[e].arg |= _BV(i);
+		else event_add(at, EVENT_STRIKE, _BV(i));
+	}
+}
+
+// Called at the start of every second, whether the PPS (or a timing frame)
+// marked it or we made it up ourselves. Returns whether it's a second that
+// we can chime in.
+static uint8_t start_second(uint8_t from_pps) {
+	uint8_t synced = sync_fresh;
+	uint8_t locked = gps_locked || synced;
+	sync_fresh = 0;
+	if (from_pps) {
+		pps_place();
+		uint32_t t = pps_ticks;
+		if (second_synthesized) {
+			// The PPS is back. See how far off we were.
+			int32_t delta = t - second_tick;
+			second_synthesized = 0;
+			if (delta < (int32_t)(F_TICK / 2)) {
+				// We already started this second. Just line back up with it.
+				stats.holdover_drift_ms = delta;
+				second_tick = t;
+				if (synced) {
+					sync_apply();
+					time_fresh = 0;
+				}
+				return 0;
+			}
+			stats.holdover_drift_ms = delta - F_TICK;
+		}
+		second_tick = t;
+		if (locked) {
+			pps_discipline();
+			holdover = 0;
+		}
+	} else {
+		second_tick += F_TICK;
+		second_synthesized = 1;
+	}
+	if (synced) sync_apply();
+	if (!time_set) return 0;
+
+	if (!(from_pps && locked) && !holdover) {
+		holdover = 1;
+		holdover_left = holdover_window;
+		STAT_SET(holdover_seconds, 0);
+	}
+
+	// If there was no RMC for this second, then count it ourselves.
+	if (!time_fresh) advance_time();
+	time_fresh = 0;
+
+	if (holdover) {
+		STAT_INC(holdover_seconds);
+		if (holdover_left == 0) return 0;
+		holdover_left--;
+	}
+	return 1;
+}
+
+// Called at the start of every second, after start_second(). Work out
+// whether to count seconds from the PPS alone, and whether the receiver's
+// time for this one is wanted.
+static void pps_count_update(uint8_t from_pps) {
+	if (!(from_pps && gps_locked && time_set)) {
+		if (pps_counting) trace(TRACE_COUNTING, 0);
+		pps_counting = 0;
+		pps_agreed = 0;
+		rx_mismatched = 0;
+	} else if (!pps_counting && pps_agreed >= PPS_AGREE) {
+		pps_counting = 1;
+		trace(TRACE_COUNTING, 1);
+	}
+	if (!pps_counting) {
+		gps_time_wanted = 1;
+		return;
+	}
+	STAT_INC(pps_counted);
+	uint16_t now = utc_hour * 60 + utc_minute;
+	gps_time_wanted = utc_second % PPS_CHECK == 0 || utc_day == 0 || now == 24 * 60 - 1
+		|| utc_day_start + now + 1 >= tz_next_change || rx_mismatched;
+}
+
+// A song is a list of steps. Each one strikes a chord (a bitmask of
+// channels, 0 for a rest) and then waits a while before the next step.
+// The song ends when the last step's wait does, and that's lined up with
+// the quarter hour. The tables are generated from songs.txt.
+#include "songs.h"
+
+#define STEP_CHORD(step) ((step) & 0x1f)
+#define STEP_MS(step) pgm_read_word(&(song_waits[(step) >> 5]))
+
+// The song that ends on each quarter, starting with the hour.
+struct song_def {
+	const uint8_t *steps;
+	uint8_t length;
+};
+
+const struct song_def PROGMEM songs[] = {
+	{ hour_song, sizeof(hour_song) / sizeof(hour_song[0]) },
+	{ first_song, sizeof(first_song) / sizeof(first_song[0]) },
+	{ second_song, sizeof(second_song) / sizeof(second_song[0]) },
+	{ third_song, sizeof(third_song) / sizeof(third_song[0]) },
+};
+
+// How long a song takes, in ticks.
+static uint32_t song_duration(const uint8_t *steps, uint8_t length) {
+	uint32_t total = 0;
+	for(uint8_t i = 0; i < length; i++)
+		total += STEP_MS(pgm_read_byte(&(steps[i])));
+	return total;
+}
+
+// Called at the start of each (chiming) second. If the song for the coming
+// quarter has to start during this second to end right on the quarter,
+// then set it going. Starting means setting up the first step, chime_ahead
+// before it's due.
+static void song_schedule(void) {
+	// Seconds from the start of this one to the next quarter hour
+	uint16_t left = (15 - minute % 15) * 60 - second;
+	uint8_t quarter = (minute / 15 + 1) % 4;
+	const uint8_t *steps = pgm_read_ptr(&(songs[quarter].steps));
+	uint8_t length = pgm_read_byte(&(songs[quarter].length));
+	int32_t begin = left * F_TICK - song_duration(steps, length) - chime_ahead;
+	if (begin < 0 || begin >= F_TICK) return;
+	song = steps;
+	trace(TRACE_SONG, quarter);
+	song_length = length;
+	song_pos = 0;
+	event_add(second_tick + begin, EVENT_SONG, 0); // from the edge, not from when we noticed it
+}
+
+// Set up the next step of the song, which is due at when, and the one
+// after it. The song is over when the last step's wait is.
+static void song_step(uint32_t when) {
+	if (song_pos >= song_length) {
+		song = NULL;
+		return;
+	}
+	uint8_t step = pgm_read_byte(&(song[song_pos++]));
+	strike_at(STEP_CHORD(step), when);
+	event_add(when + STEP_MS(step) - chime_ahead, EVENT_SONG, 0);
+}
+
+// Called at the start of each (chiming) second. If the next one is the top
+// of the hour, set the hour strike going: once every four seconds from
+// then, one for each hour (on a 12 hour clock).
+static void hour_schedule(void) {
+	if (minute != 59 || second != 59) return;
+	uint8_t h = (hour + 1) % 12;
+	if (h == 0) h = 12;
+	event_add(second_tick + F_TICK - chime_ahead, EVENT_HOUR, h - 1);
+}
+
+// Called at the start of each second once the time is set. Check the
+// receiver's leap second default at half past every hour.
+static void leap_schedule(void) {
+	if (event_queued(EVENT_LEAP_CHECK)) return;
+	uint16_t left = (1800 + 3600 - (minute * 60 + second)) % 3600;
+	event_add(second_tick + left * F_TICK, EVENT_LEAP_CHECK, 0);
+}
+
+// Do the first event in the queue, which is due.
+static void event_run(void) {
+	struct event ev = events[0];
+	event_remove(0);
+	switch(ev.type) {
+		case EVENT_STRIKE:
+			do_chord(ev.arg);
+			break;
+		case EVENT_SONG:
+			song_step(ev.when + chime_ahead);
+			break;
+		case EVENT_HOUR:
+			strike_at(_BV(4), ev.when + chime_ahead);
+			if (ev.arg) event_add(ev.when + 4 * F_TICK, EVENT_HOUR, ev.arg - 1);
+			break;
+		case EVENT_LEAP_CHECK:
+			// And if we never did get the UTC reference date, ask again.
+			cmd_post(CMD_LEAP_CHECK);
+			if (utc_ref_year == 0) cmd_post(CMD_UTC_REF_FETCH);
+			event_add(ev.when + 3600 * F_TICK, EVENT_LEAP_CHECK, 0);
+			break;
+	}
+}
+
+// How long after a second is due to wait for whatever marks it
+static inline uint8_t second_grace(void) {
+	if (second_synthesized) return 0;
+	return (sync_role == SYNC_FOLLOWER && !gps_locked)?SYNC_GRACE:PPS_GRACE;
+}
+
+static inline void sooner(uint32_t *next, uint32_t when) {
+	if ((int32_t)(when - *next) < 0) *next = when;
+}
+
+// The first tick at which the main loop has something to do, if nothing
+// wakes it before then. It's no later than TICK_WAKE_MAX from now.
+static uint32_t next_deadline(uint32_t now) {
+	uint32_t next = now + TICK_WAKE_MAX;
+	if (tx_pos == tx_len) {
+		// Something's waiting only for the UART.
+		if (cmd_current == CMD_NONE && cmd_pending) sooner(&next, cmd_retry_at?cmd_retry_at:now);
+		if (trace_dumping() || sync_due) sooner(&next, now);
+	}
+	if (cmd_current != CMD_NONE) sooner(&next, cmd_deadline);
+	if (time_set && second_tick) sooner(&next, second_tick + F_TICK + second_grace());
+	if (events_len) sooner(&next, events[0].when);
+	return next;
+}
 
 // main() never returns.
 void __ATTR_NORETURN__ main(void) {
@@ -627,6 +2161,9 @@ void __ATTR_NORETURN__ main(void) {
 	// Leave on only the parts of the chip we use.
 	PRR = ~( _BV(PRUSART0) | _BV(PRTIM2));
 
+	// Everything happens in response to an interrupt, so idle between them.
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
 	// pull up on the unused pins (the programming interface)
 	PORTA = 0;
 	PUEA = _BV(4) | _BV(5) | _BV(6);
@@ -636,27 +2173,32 @@ void __ATTR_NORETURN__ main(void) {
 	PUEB = 0; // no pull-ups
 	DDRB = _BV(0) | _BV(1) | _BV(2); // all outputs
 
-	UBRR0H = UBRRH_VALUE;
-	UBRR0L = UBRRL_VALUE;
-#if USE_2X
-	UCSR0A = _BV(U2X0);
-#else
-	UCSR0A = 0;
-#endif
+	uart_baud(0);
 
 	UCSR0B = _BV(RXCIE0) | _BV(RXEN0) | _BV(TXEN0); // RX interrupt and TX+RX enable
 
 	// 8N1
 	UCSR0C = _BV(UCSZ00) | _BV(UCSZ01);
 
-	tx_buf_head = tx_buf_tail = 0;
-	rx_str_len = 0;
-	nmea_ready = 0;
-
-	// millisecond timer for Timer 2.
-	TCCR2B = _BV(WGM22) | _BV(CS22); // prescale by 256, CTC mode
-	TIMSK2 = _BV(OCIE2A); // interrupt on compare match A
-	OCR2A = TICK_BASE_CYCLE + 1; // start with a long cycle
+	tx_pos = tx_len = 0;
+#ifdef WITH_TRACE
+	trace_pos = 0;
+#endif
+	trace_dump_asked = 0;
+	trace_dump_pos = TRACE_DUMP_END;
+	memset(&stats, 0, sizeof(stats));
+	rx_slot = 0;
+	rx_parse_slot = 0;
+
+	// millisecond clock from Timer 2.
+	tick_rate = tick_len = TICK_NOMINAL;
+	tick_recip = 0xffffffffUL / TICK_NOMINAL;
+	tick_count = 0;
+	tick_count_frac = 0;
+	timer_high = 0;
+	solenoids_on = 0;
+	TCCR2B = _BV(CS22); // prescale by 256, normal mode
+	TIMSK2 = _BV(TOIE2) | _BV(OCIE2B); // interrupt on overflow and compare match B
 
 	ticks = 1;
 
@@ -664,113 +2206,132 @@ void __ATTR_NORETURN__ main(void) {
 	PCMSK0 = _BV(PCINT7); // pin change interrupt on PA7
 	GIMSK = _BV(PCIE0); // enable pin change interrupt 0
 
-	uint8_t ee_rd = eeprom_read_byte(EE_TIMEZONE);
-	if (ee_rd == 0xff)
-		tz_hour = -8;
-	else
-		tz_hour = ee_rd - 12;
-	dst_mode = eeprom_read_byte(EE_DST_MODE);
-	if (dst_mode > DST_MODE_MAX) dst_mode = DST_US;
+	tz_load();
+	utc_day = 0; // work out the offset on the first fix
+
+	uint8_t ee_rd;
 
 	// start hour and end hour are inclusive, and are the times when the chimes will operate (24 hour time)
 	start_hour = eeprom_read_byte(EE_START_HOUR);
 	if (start_hour > 23) start_hour = 7;
 	end_hour = eeprom_read_byte(EE_END_HOUR);
 	if (end_hour > 23) end_hour = 22;
+	plan_day = 0xffffffff; // work out the plan once we know the day
+
+	// The holdover window is in hours.
+	ee_rd = eeprom_read_byte(EE_HOLDOVER);
+	holdover_window = ((ee_rd == 0xff)?4:ee_rd) * 3600UL;
 
 	gps_locked = 0;
-	song_start = 0;
+	pps_counting = 0;
+	pps_agreed = 0;
+	gps_time_wanted = 1;
+	rx_phase = 0;
+	rx_phase_rejects = 0;
+	rx_ahead = 0;
+	rx_mismatched = 0;
+	time_set = 0;
+	second_tick = 0;
+	second_synthesized = 0;
+	holdover = 0;
+	song = NULL;
+	events_len = 0;
+#ifdef WITH_SYNTH
+	chime_synth = eeprom_read_byte(EE_OUTPUT) == 1;
+	if (chime_synth) synth_init();
+#endif
+	chime_cal_load();
+
+	// Find out the receiver's UTC reference date, so we can keep it up to date.
+	cmd_current = CMD_NONE;
+	cmd_pending = 0;
+	cmd_retry_at = 0;
+	cmd_post(CMD_UTC_REF_FETCH);
+
+#ifdef WITH_BINARY
+	gps_mode = eeprom_read_byte(EE_GPS_MODE);
+	if (gps_mode > GPS_BINARY_FAST) gps_mode = GPS_NMEA;
+#endif
+	gps_save = eeprom_read_byte(EE_GPS_SAVE) == 1;
+#ifdef WITH_SYNC
+	sync_role = eeprom_read_byte(EE_SYNC_ROLE);
+	sync_delay = eeprom_read_byte(EE_SYNC_DELAY);
+	if (sync_delay == 0xff) sync_delay = 0;
+#endif
+	sync_due = 0;
+	sync_fresh = 0;
+	gps_leap = 0xff;
+	gps_configure();
 
 	// Turn on interrupts
 	sei();
 
 	while(1) {
 		wdt_reset();
-		if (nmea_ready) {
+		if (rx_msg[rx_parse_slot].type != MSG_NONE) {
 			// Do this out here so it's not in an interrupt-disabled context.
-			handleGPS();
-			rx_str_len = 0; // now clear the buffer
-			nmea_ready = 0;
+			// The ISR won't touch this slot until we hand it back.
+			handleGPS((const struct gps_msg *)&(rx_msg[rx_parse_slot]));
+			rx_msg[rx_parse_slot].type = MSG_NONE; // now hand the slot back
+			if (++rx_parse_slot == RX_SLOTS) rx_parse_slot = 0;
 			continue;
 		}
 		uint32_t now = timer_value();
-
-		if (new_second) {
+		// Do whatever's due first, as a strike is late by whatever comes
+		// before it. Setting up a song step can queue a strike that's due
+		// right away, so keep going until nothing is.
+		while (events_len && (int32_t)(now - events[0].when) >= 0) event_run();
+		sync_service();
+		cmd_service(now);
+		trace_service();
+
+		uint8_t from_pps = new_second;
+		// Carry on by ourselves if the PPS doesn't come. Give it a little leeway
+		// the first time. An edge just before a tick boundary starts its second
+		// at that boundary, which can still be to come.
+		if (from_pps || (time_set && second_tick && (int32_t)(now - second_tick) >= (int32_t)(F_TICK + second_grace()))) {
 			new_second = 0;
-			if (!gps_locked) continue; // ignore unless locked
-
-			{
-				// We need to take into account the hour it's about to be
-				uint8_t h = ((minute < 50)?hour:hour + 1) % 24;
-
-				if (start_hour > end_hour) {
-					// this means we chime *before* end and *after* start.
-					// So if it's between start and end, abstain.
-					if (h > start_hour && h < end_hour) continue;
-				} else {
-					// This means we DON'T chime if before start or
-					// after end.
-					if (h < start_hour || h > end_hour) continue;
-				}
-			}
-
-			if (minute < 2) { // depending on how slow you chime, it might take up to 2 minutes.
-				// Create AM/PM time
-				uint8_t h = hour;
-			        if (h == 0) { h = 12; }
-				else if (h > 12) h -= 12;
-				// second within the hour
-				uint16_t s = second + minute * 60;
-				if ((!(s % 4)) && (s / 4) < h) { // every third second, starting at 0
-					do_chime(4);
-				}
+			uint8_t chime = start_second(from_pps);
+			pps_count_update(from_pps);
+			trace(TRACE_SECOND, from_pps);
+#ifdef WITH_BINARY
+			// If the receiver stops talking to us in binary, it may have been reset.
+			if (gps_mode != GPS_NMEA && ++gps_quiet >= GPS_QUIET) gps_configure();
+#endif
+			// ... or if it starts sending everything again.
+			if (gps_rmc_only && rx_ignored > GPS_CHATTY) {
+				if (++gps_chatty == 2) gps_configure();
+			} else {
+				gps_chatty = 0;
 			}
+			rx_ignored = 0;
+			// Every hour, check to see if the leap second value in the receiver is out-of-date.
+			if (time_set) leap_schedule();
+			if (!chime) continue;
+			if (sync_role == SYNC_MASTER) sync_due = 1;
 
-#if 0
-			// Time for a song?
-			if (second == 0) {
-				switch(minute) {
-					case 15:
-						song = first_song;
-						song_length = sizeof(first_song);
-						song_pos = -1;
-						song_start = now; // GO!
-						break;
-					case 30:
-						song = second_song;
-						song_length = sizeof(second_song);
-						song_pos = -1;
-						song_start = now; // GO!
-						break;
-					case 45:
-						song = third_song;
-						song_length = sizeof(third_song);
-						song_pos = -1;
-						song_start = now; // GO!
-						break;
-				}
-			}
-#endif
+			if (!plan_chimes()) continue;
 
-			// The hour song is special - it has to be early so the chimes are on-time.
-			if (minute == 59 && second == (60 - sizeof(hour_song) * (BEAT_TIME / 1000))) {
-				song = hour_song;
-				song_length = sizeof(hour_song);
-				song_pos = -1;
-				song_start = now; // GO!
-			}
+			hour_schedule();
+			if (song == NULL) song_schedule();
 		}
-		// is it time for the next song note?
-		if (song_start && (now - song_start >= (song_pos + 1) * BEAT_TIME)) {
-			if (++song_pos >= song_length) { // Are we done?
-				song_start = 0;
-				continue;
-			}
-			uint8_t note = pgm_read_byte(&(song[song_pos]));
-			if (note <= 4) // it's not a rest
-				do_chime(note);
-			continue;
+
+		// Nothing more to do until the next interrupt or deadline. Check with
+		// interrupts off, or one could slip in between and leave us asleep
+		// with work to do. sei() always lets the next instruction run before
+		// any interrupt. If the timer is already at the deadline, go around.
+		uint32_t next = next_deadline(now);
+		if ((int32_t)(next - now) <= 0) continue;
+		uint16_t wake = tick_to_count(next);
+		cli();
+		OCR2B = wake;
+		if (!new_second && rx_msg[rx_parse_slot].type == MSG_NONE && (int16_t)(wake - TCNT2) > 0) {
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
 		}
+		sei();
 	}
 	__builtin_unreachable();
 }
@@ -2,29 +2,58 @@
 
 # Chime clock
 # Copyright 2019 Nicholas W. Sayer
-# 
+#
 # This program is free software; you can redistribute it and/or modify
 # it under the terms of the GNU General Public License as published by
 # the Free Software Foundation; either version 2 of the License, or
 # (at your option) any later version.
-# 
+#
 # This program is distributed in the hope that it will be useful,
 # but WITHOUT ANY WARRANTY; without even the implied warran of
 # MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 # GNU General Public License for more details.
-# 
+#
 # You should have received a copy of the GNU General Public License along
 # with this program; if not, write to the Free Software Foundation, Inc.,
 # 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 
-# Run this from cron at 14, 29, 44 and 59 past the hour, for any hour
-# you want to chime.
+# Either run this from cron at 14, 29, 44 and 59 past the hour, for any
+# hour you want to chime:
 #
-# example:
 # 14,29,44,59 7-22 * * * $HOME/chime.py
+#
+# or start it once with -d and leave it running, which saves starting
+# Python every quarter. -H gives the hours to chime, the same way as the
+# cron line does (the hour the song starts in):
+#
+# @reboot $HOME/chime.py -d -H 7-22
+#
+# Every strike is worked out ahead of time and then waited for with
+# clock_nanosleep() to an absolute CLOCK_REALTIME deadline, so nothing
+# builds up from one note to the next, and a step of the system clock
+# moves the strikes with it.
+#
+# -m prints what would go to the GPIO pins instead, so this runs anywhere,
+# and -p prints a day's strikes (today's, or -p 2019-11-03) and exits.
+#
+# -b 10000 runs the daemon for that many hours on a simulated clock, from
+# 2019-01-01 in $TZ (or US Pacific time, when that's not set), and reports
+# how far each strike was from where it belonged. Every simulated wake up
+# is as late as one of the real wake ups it times first, so the result is
+# what this machine would do. Compare it with the firmware's "make bench".
+#
+# The songs are in chime_songs.py, which "make songs" generates from
+# songs.txt (and which is checked in). Keep it next to this script.
 
-import RPi.GPIO as GPIO
+import argparse
+import ctypes
+import ctypes.util
+import datetime
+import errno
+import os
+import random
 import time
+from chime_songs import first_song, second_song, third_song, hour_song
 
 # GPIO numbers for the chimes. 0-3 are low-high quarters, 4 is hour gong.
 # These are the BCM numbers
@@ -33,95 +62,292 @@ channels = [17, 18, 27, 22, 23]
 # 20 ms solenoid pulses
 solenoid_time = 0.02
 
-first_song = [ 3, 2, 1, 0 ]
-second_song = [ 1, 3, 2, 0, 0xff, 1, 2, 3, 1 ]
-third_song = [ 3, 1, 2, 0, 0xff, 0, 2, 3, 1, 0xff, 3, 2, 1, 0 ]
-hour_song = [ 1, 3, 2, 0, 0xff, 1, 2, 3, 1, 0xff, 3, 1, 2, 0, 0xff, 0, 2, 3, 1, 0xff, 0xff, 0xff ]
+# The hour strikes are this many seconds apart, the first on the hour
+strike_interval = 3
+
+# A strike more than this many seconds late (the clock was stepped, or the
+# machine was asleep) is skipped rather than played out of time
+late_limit = 1.0
+
+songs = [hour_song, first_song, second_song, third_song]
+
+# Stands in for RPi.GPIO, printing each change instead
+class MockGPIO:
+	BCM = 11
+	OUT = 0
+	HIGH = 1
+	LOW = 0
+
+	def setmode(self, mode):
+		pass
+
+	def setup(self, pin, mode, initial=0):
+		pass
 
-def do_chime(chime):
-	if (chime >= len(channels)):
+	def output(self, pins, level):
+		now = clock.time()
+		print("%.6f %s.%03d %s %s" % (now, time.strftime("%H:%M:%S", time.localtime(now)),
+			int(now * 1000) % 1000, "on" if level else "off", " ".join(str(p) for p in pins)), flush=True)
+
+	def cleanup(self):
+		pass
+
+# Remembers each change, for the benchmark
+class RecordingGPIO(MockGPIO):
+	def __init__(self):
+		self.changes = []
+
+	def output(self, pins, level):
+		self.changes.append((clock.time(), pins, level))
+
+# Sleep until the given time.time(). Falls back to time.sleep() where
+# there's no clock_nanosleep() (it's only waiting, then).
+CLOCK_REALTIME = 0
+TIMER_ABSTIME = 1
+
+class timespec(ctypes.Structure):
+	_fields_ = [("tv_sec", ctypes.c_long), ("tv_nsec", ctypes.c_long)]
+
+try:
+	clock_nanosleep = ctypes.CDLL(ctypes.util.find_library("c"), use_errno=True).clock_nanosleep
+	clock_nanosleep.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.POINTER(timespec), ctypes.POINTER(timespec)]
+except (OSError, AttributeError):
+	clock_nanosleep = None
+
+def sleep_until(when):
+	if (clock_nanosleep is not None):
+		ts = timespec(int(when), int((when - int(when)) * 1e9))
+		while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, ctypes.byref(ts), None) == errno.EINTR):
+			pass
 		return
-	GPIO.output(channels[chime], GPIO.HIGH)
-	time.sleep(solenoid_time)
-	GPIO.output(channels[chime], GPIO.LOW)
-
-def get_time():
-	global tm_hour, tm_minute, tm_second
-	struct_time = time.localtime()
-	tm_hour = struct_time[3]
-	tm_minute = struct_time[4]
-	tm_second = struct_time[5]
-
-def quarters(song):
-	start = time.time()
-	song_pos = 0
 	while True:
-		if (song_pos > (time.time() - start)):
-			time.sleep(0.1)
-			continue
-		do_chime(song[song_pos])
-		song_pos = song_pos + 1
-		if (song_pos >= len(song)):
+		wait = when - time.time()
+		if (wait <= 0):
 			return
+		time.sleep(wait)
+
+# Where the time comes from, and how to wait for it
+class RealClock:
+	def time(self):
+		return time.time()
+
+	def sleep(self, seconds):
+		time.sleep(seconds)
+
+	def sleep_until(self, when):
+		sleep_until(when)
+
+class SimDone(Exception):
+	pass
+
+# Time that only moves when it's slept through. Each wake up is late by one
+# of the latencies, picked at random. Raises SimDone at the stop time.
+class SimClock:
+	def __init__(self, start, stop, latencies):
+		self.now = start
+		self.stop = stop
+		self.latencies = latencies
+		self.random = random.Random(1)
 
-def wait_for(second):
+	def time(self):
+		return self.now
+
+	def sleep(self, seconds):
+		self.sleep_until(self.now + seconds)
+
+	def sleep_until(self, when):
+		when = max(when, self.now)
+		if (when >= self.stop):
+			raise SimDone()
+		self.now = when + self.random.choice(self.latencies)
+
+clock = RealClock()
+
+# Strike all of the channels in the chord (a bitmask) at once
+def do_chord(chord):
+	pins = [channels[i] for i in range(len(channels)) if chord & (1 << i)]
+	if (len(pins) == 0):
+		return
+	GPIO.output(pins, GPIO.HIGH)
+	clock.sleep(solenoid_time)
+	GPIO.output(pins, GPIO.LOW)
+
+# The strikes, as (time, chord), for the quarter that ends at the given
+# time: the song, timed to end right on it, then on the hour the strikes.
+def quarter_plan(end):
+	tm = time.localtime(end)
+	quarter = tm.tm_min // 15
+	song = songs[quarter]
+	plan = []
+	when = end - sum(ms for (chord, ms) in song) / 1000.0
+	for (chord, ms) in song:
+		plan.append((when, chord))
+		when = when + ms / 1000.0
+	if (quarter == 0):
+		# make AM/PM hour
+		hour_12 = tm.tm_hour % 12
+		if (hour_12 == 0):
+			hour_12 = 12
+		plan.extend((end + i * strike_interval, 1 << 4) for i in range(hour_12))
+	return plan
+
+# Local midnight at the start of the day
+def midnight(day):
+	return time.mktime((day.year, day.month, day.day, 0, 0, 0, 0, 0, -1))
+
+# Every strike for the quarters that end on the given local day (the last
+# is midnight at its end), in the given hours. These are the real quarter
+# hours, so the hour DST ends in chimes twice, like the firmware does,
+# and the hour it starts in not at all.
+def day_plan(day, hours):
+	plan = []
+	end = midnight(day)
+	stop = midnight(day + datetime.timedelta(days=1))
+	while (end < stop):
+		end = end + 15 * 60
+		if (time.localtime(end - 60).tm_hour not in hours):
+			continue
+		plan.extend(quarter_plan(end))
+	plan.sort()
+	return plan
+
+def run(plan):
+	for (when, chord) in plan:
+		if (clock.time() - when > late_limit):
+			continue
+		clock.sleep_until(when)
+		do_chord(chord)
+
+def daemon(hours):
+	day = datetime.date.fromtimestamp(clock.time())
 	while True:
-		get_time()
-		if (second == tm_second):
-			return
-		wait_time = second - (tm_second + 1)
-		if (wait_time < 0):
-			wait_time = wait_time + 60
-		elif (wait_time == 0):
-			wait_time = 0.1
-		time.sleep(wait_time)
+		run(day_plan(day, hours))
+		day = day + datetime.timedelta(days=1)
+
+# How many real wake ups to time for the simulated clock
+calibrate_count = 500
+
+def calibrate():
+	late = []
+	for i in range(calibrate_count):
+		when = time.time() + 0.002
+		sleep_until(when)
+		late.append(time.time() - when)
+	return late
+
+def percentiles(errors):
+	errors = sorted(errors)
+	return "p50 %6.0f  p99 %6.0f  max %6.0f us" % tuple(errors[int(p * (len(errors) - 1))] * 1e6 for p in (0.5, 0.99, 1))
+
+# Where each strike belongs, as (time, chord, song), for every real quarter
+# hour after start, and how many of the hours are 12. This steps through
+# the quarters one at a time rather than a day at a time, so it doesn't
+# share day_plan()'s mistakes.
+def bench_score(start, hours, chime_hours):
+	names = ["hour", "first", "second", "third"]
+	score = []
+	twelves = 0
+	for end in range(start + 15 * 60, start + hours * 3600 + 1, 15 * 60):
+		tm = time.localtime(end)
+		if (time.localtime(end - 60).tm_hour not in chime_hours):
+			continue
+		when = end
+		for (chord, ms) in reversed(songs[tm.tm_min // 15]):
+			when = when - ms / 1000.0
+			score.append((when, chord, names[tm.tm_min // 15]))
+		if (tm.tm_min == 0):
+			for i in range((tm.tm_hour + 11) % 12 + 1):
+				score.append((end + i * strike_interval, 1 << 4, "strikes"))
+			twelves = twelves + (tm.tm_hour % 12 == 0)
+	score.sort()
+	return (score, twelves)
+
+def bench(hours, chime_hours):
+	global clock, GPIO
+	if ("TZ" not in os.environ):
+		os.environ["TZ"] = "PST8PDT,M3.2.0,M11.1.0"
+		time.tzset()
+	late = calibrate()
+	print("wake up latency, %d clock_nanosleep() calls: %s" % (len(late), percentiles(late)))
+
+	start = int(midnight(datetime.date(2019, 1, 1)))
+	# Long enough for the last hour's strikes, not the next song
+	stop = start + hours * 3600 + 60
+	clock = SimClock(start, stop, late)
+	GPIO = RecordingGPIO()
+	began = time.time()
+	try:
+		daemon(chime_hours)
+	except SimDone:
+		pass
+	took = time.time() - began
+
+	struck = [(when, sum(1 << channels.index(pin) for pin in pins)) for (when, pins, level) in GPIO.changes if level]
+	(score, twelves) = bench_score(start, hours, chime_hours)
+	changes = sum(time.localtime(t).tm_isdst != time.localtime(t + 3600).tm_isdst for t in range(start, stop, 3600))
+	print("%d hours from 2019-01-01 in %s, %d DST changes, %d strikes (%d hours of 12) in %.1f s:" %
+		(hours, os.environ["TZ"], changes, len(struck), twelves, took))
+	for i in range(max(len(struck), len(score))):
+		if (i >= len(struck) or i >= len(score) or struck[i][1] != score[i][1] or abs(struck[i][0] - score[i][0]) > late_limit):
+			want = time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(score[i][0])) if i < len(score) else "nothing"
+			got = time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(struck[i][0])) if i < len(struck) else "nothing"
+			print("  strike %d: wanted %s, got %s" % (i, want, got))
+			return 1
+	errors = {}
+	for (want, got) in zip(score, struck):
+		errors.setdefault(want[2], []).append(got[0] - want[0])
+	for name in ["first", "second", "third", "hour", "strikes"]:
+		if (name in errors):
+			print("  %-8s %7d  %s" % (name, len(errors[name]), percentiles(errors[name])))
+	return 0
+
+def parse_hours(spec):
+	hours = set()
+	for part in spec.split(","):
+		(first, dash, last) = part.partition("-")
+		last = last if dash else first
+		if (not first.isdigit() or not last.isdigit() or int(first) > int(last) or int(last) > 23):
+			raise argparse.ArgumentTypeError("hours are like 7-22 or 0,6-9,12")
+		hours.update(range(int(first), int(last) + 1))
+	return hours
+
+parser = argparse.ArgumentParser(description="Chime the quarters and strike the hours.")
+parser.add_argument("-d", "--daemon", action="store_true", help="keep running, chiming every quarter")
+parser.add_argument("-H", "--hours", type=parse_hours, default=set(range(24)), help="the hours to chime with -d or -p, like 7-22 (default all)")
+parser.add_argument("-m", "--mock", action="store_true", help="print the GPIO changes instead of making them")
+parser.add_argument("-p", "--plan", nargs="?", const=datetime.date.today(), type=datetime.date.fromisoformat,
+	metavar="DATE", help="print the day's strikes (default today) and exit")
+parser.add_argument("-b", "--bench", type=int, metavar="HOURS", help="time the strikes over that many simulated hours and exit")
+args = parser.parse_args()
+
+if (args.bench):
+	exit(bench(args.bench, args.hours))
+
+if (args.plan):
+	for (when, chord) in day_plan(args.plan, args.hours):
+		ms = int(round(when * 1000))
+		print("%s.%03d %s" % (time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(ms // 1000)), ms % 1000,
+			" ".join(str(i) for i in range(len(channels)) if chord & (1 << i))))
+	exit(0)
+
+if (args.mock):
+	GPIO = MockGPIO()
+else:
+	import RPi.GPIO as GPIO
 
 GPIO.setmode(GPIO.BCM)
 for pin in channels:
 	GPIO.setup(pin, GPIO.OUT, initial=GPIO.LOW)
 
 try:
-
-	get_time()
-
-	if (tm_minute == 14):
-		wait_for(0)
-		quarters(first_song)
-	elif (tm_minute == 29):
-		wait_for(0)
-		quarters(second_song)
-	elif (tm_minute == 44):
-		wait_for(0)
-		quarters(third_song)
-	elif (tm_minute == 59):
-		wait_for(60 - len(hour_song)) # wait for the start second
-		quarters(hour_song)
-
-		# Wait for the proper start of the minute
-		get_time()
-		if (tm_second > 0):
-			wait_for(0)
-
-		chime_num = 0
-		start = time.time()
-
-		while True:
-
-			if (time.time() - start < chime_num * 3):
-				time.sleep(0.1)
-				continue
-
-			do_chime(4)
-			chime_num = chime_num + 1
-			# make AM/PM hour
-			get_time()
-			hour_12 = tm_hour
-			if (hour_12 == 0):
-				hour_12 = 12
-			elif (hour_12 > 12):
-				hour_12 = hour_12 - 12
-			if (chime_num >= hour_12):
-				break
-	
+	if (args.daemon):
+		daemon(args.hours)
+	else:
+		# The song ends on the quarter, which is the start of the next minute
+		quarter = (int(clock.time()) // 60 + 1) * 60
+		if (time.localtime(quarter).tm_min % 15 == 0):
+			run(quarter_plan(quarter))
+except KeyboardInterrupt:
+	pass
 finally:
 	GPIO.cleanup()
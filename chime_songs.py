@@ -0,0 +1,9 @@
+# Generated from songs.txt by host/songc. Edit that, not this.
+#
+# Each step is (chord, ms): strike the channels in the chord (a bitmask),
+# then wait ms before the next step. A song ends when its last wait does.
+
+hour_song = [ (0x02, 650), (0x08, 650), (0x04, 650), (0x01, 1950), (0x02, 650), (0x04, 650), (0x08, 650), (0x02, 1950), (0x08, 650), (0x02, 650), (0x04, 650), (0x01, 1950), (0x01, 650), (0x04, 650), (0x08, 650), (0x02, 3950) ]
+first_song = [ (0x08, 650), (0x04, 650), (0x02, 650), (0x01, 1950) ]
+second_song = [ (0x02, 650), (0x08, 650), (0x04, 650), (0x01, 1950), (0x02, 650), (0x04, 650), (0x08, 650), (0x02, 1950) ]
+third_song = [ (0x08, 650), (0x02, 650), (0x04, 650), (0x01, 1950), (0x01, 650), (0x04, 650), (0x08, 650), (0x02, 1950), (0x08, 650), (0x04, 650), (0x02, 650), (0x01, 1950) ]
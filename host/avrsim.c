@@ -0,0 +1,517 @@
+/*
+
+    GPS Clock - cycle level simulation under simavr
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// usage: avrsim [-s seconds] [-p ppm] [-a] GPS_Chime_Clock.elf
+//
+// Runs the real firmware, instruction by instruction, on simavr with a
+// virtual receiver: a PPS edge on PA7 at the top of each second (off from
+// the 8 MHz CPU clock by ppm), and its NMEA output on USART0 at 9600 baud
+// starting 100 ms later. It ACKs the firmware's commands and answers the
+// queries, and honors the switch to RMC only. The run starts at
+// 16:57:00 UTC (09:57 PDT, the blank EEPROM's time zone), three minutes
+// before a quarter.
+//
+// Everything is measured in CPU cycles and reported in microseconds:
+//
+//   - how long after the PPS edge PCINT0_vect starts (the other interrupts
+//     and cli() hold it off),
+//   - how long each interrupt handler runs,
+//   - how far each rising edge on the chime pins is from when it was due
+//     in true time (counting from the PPS): the song for each quarter
+//     ending on the quarter, and the hour after each hour song, from 7:00
+//     to 22:59 (the blank EEPROM's hours), each channel early by its lead,
+//   - the longest time between wdr instructions, against the 250 ms
+//     watchdog,
+//   - and, in bytes, the deepest the stack goes, for the headroom left
+//     between it and what make size says the data takes.
+//
+// The run fails if any of those is over its budget, if the firmware
+// resets, or if it doesn't strike just what was due.
+//
+// With -a, EEPROM byte 9 is set so that the bells are synthesized. Then a
+// strike is the write to TCNT0 that starts a chord (which sounds a sample
+// later), and there's one more budget: the cycles TIMER0_COMPA_vect spends
+// on each sample. It holds everything else off while it runs, so the PPS
+// gets that much more time too.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "sim_interrupts.h"
+#include "sim_cycle_timers.h"
+#include "avr_eeprom.h"
+#include "avr_ioport.h"
+#include "avr_uart.h"
+
+#include "sim_tn841.h"
+
+#define PROGMEM
+#include "../songs.h"
+
+#define F_CPU 8000000UL
+#define CYCLES_US (F_CPU / 1000000)
+#define CYCLES_MS (F_CPU / 1000)
+// 10 bits at 9600 baud
+#define BYTE_CYCLES (F_CPU * 10 / 9600)
+// How long after the PPS the receiver starts talking, and how long the
+// PPS pulse is
+#define NMEA_DELAY (100 * CYCLES_MS)
+#define PPS_WIDTH (100 * CYCLES_MS)
+// How long the receiver takes to answer a command
+#define ACK_DELAY (20 * CYCLES_MS)
+
+// 2016-05-26 16:57:00 UTC, which is 09:57:00 PDT
+#define START (1464281820)
+// The first second starts a little after power up.
+#define START_CYCLE (50 * CYCLES_MS)
+// The blank EEPROM's chiming hours, in minutes
+#define CHIME_START (7 * 60)
+#define CHIME_END (22 * 60 + 59)
+
+#define CHANNELS 5
+#define EE_CHIME_CAL 32
+#define STEP_CHORD(step) ((step) & 0x1f)
+#define STEP_MS(step) (song_waits[(step) >> 5])
+
+// Budgets, in microseconds
+#define BUDGET_PPS 50 // PPS edge to PCINT0_vect
+#define BUDGET_STRIKE 250 // a strike from when it was due
+#define BUDGET_WDR 125000 // half the watchdog timeout
+#define BUDGET_SAMPLE 50 // a synthesizer sample, 400 of the 1000 cycles between them
+
+// Histograms are in cycles. Anything longer goes in the last bucket.
+#define HIST_LEN 8192
+
+struct hist {
+	const char *name;
+	uint32_t count[HIST_LEN];
+	uint64_t n;
+	avr_cycle_count_t max;
+};
+
+static struct hist pps_hist = { "PPS to PCINT0_vect" };
+static struct hist strike_hist = { "strike from due" };
+static struct hist isr_hist[TN841_VECTORS] = {
+	[TN841_PCINT0] = { "PCINT0_vect" },
+	[TN841_TIMER2_COMPA] = { "TIMER2_COMPA_vect" },
+	[TN841_TIMER2_COMPB] = { "TIMER2_COMPB_vect" },
+	[TN841_TIMER2_OVF] = { "TIMER2_OVF_vect" },
+	[TN841_USART0_RX] = { "USART0_RX_vect" },
+	[TN841_USART0_UDRE] = { "USART0_UDRE_vect" },
+	[TN841_TIMER0_COMPA] = { "TIMER0_COMPA_vect" },
+};
+
+static void hist_add(struct hist *h, avr_cycle_count_t cycles) {
+	h->count[(cycles < HIST_LEN)?cycles:HIST_LEN - 1]++;
+	h->n++;
+	if (cycles > h->max) h->max = cycles;
+}
+
+static double hist_pct(const struct hist *h, double pct) {
+	uint64_t want = h->n * pct / 100, seen = 0;
+	for(int i = 0; i < HIST_LEN; i++) {
+		seen += h->count[i];
+		if (seen > want) return (double)i / CYCLES_US;
+	}
+	return (double)h->max / CYCLES_US;
+}
+
+// Prints the distribution, and returns whether the worst is over budget (us).
+static int hist_report(const struct hist *h, uint32_t budget) {
+	printf("  %-20s %10llu  p50 %7.1f  p99 %7.1f  max %7.1f us", h->name, (unsigned long long)h->n,
+		hist_pct(h, 50), hist_pct(h, 99), (double)h->max / CYCLES_US);
+	if (budget == 0) {
+		printf("\n");
+		return 0;
+	}
+	int over = h->max > (avr_cycle_count_t)budget * CYCLES_US;
+	printf("  (budget %u us)%s\n", budget, over?" OVER":"");
+	return over;
+}
+
+static avr_t *avr;
+static avr_irq_t *uart_in, *pps_pin;
+
+static avr_cycle_count_t second_cycles; // how long a true second is
+static uint32_t sec; // seconds since the start
+static avr_cycle_count_t pps_at; // the last PPS edge
+static int pps_pending; // and PCINT0_vect hasn't started since
+
+// The receiver
+static uint8_t out[2048];
+static size_t out_len, out_pos;
+static uint8_t tx[32];
+static size_t tx_len;
+static int rmc_only; // told to send nothing but RMC
+static uint16_t ref_year = 2006;
+static uint8_t ref_mon = 1, ref_day = 1;
+static uint8_t leap_default = 16;
+
+static avr_cycle_count_t isr_start[TN841_VECTORS];
+static uint8_t pins; // the chime channels that are on
+static uint64_t strikes, unscored;
+
+// What ought to be struck: when (in cycles) and which channels
+struct due {
+	avr_cycle_count_t at;
+	uint8_t chord;
+};
+
+static struct due score[4096]; // five days or so
+static size_t score_len;
+// The next in the score for each channel, and for any (synthesized bells)
+static size_t score_pos[CHANNELS + 1];
+static uint8_t lead[CHANNELS]; // in ms
+static avr_cycle_count_t last_wdr, wdr_gap;
+static uint32_t resets;
+static uint16_t sp_min = 0xffff;
+
+static avr_cycle_count_t gps_byte(avr_t *avr, avr_cycle_count_t when, void *param) {
+	if (out_pos == out_len) {
+		out_pos = out_len = 0;
+		return 0;
+	}
+	avr_raise_irq(uart_in, out[out_pos++]);
+	return when + BYTE_CYCLES;
+}
+
+// Have the receiver send something, after whatever it's sending already.
+static void gps_send(const void *data, size_t len, avr_cycle_count_t delay) {
+	if (out_len + len > sizeof(out)) return;
+	int idle = out_pos == out_len;
+	memcpy(out + out_len, data, len);
+	out_len += len;
+	if (idle) avr_cycle_timer_register(avr, delay, gps_byte, NULL);
+}
+
+static void gps_nmea(const char *body) {
+	uint8_t checksum = 0;
+	for(const char *p = body; *p; p++) checksum ^= *p;
+	char line[96];
+	int len = snprintf(line, sizeof(line), "$%s*%02X\r\n", body, checksum);
+	gps_send(line, len, NMEA_DELAY);
+}
+
+static void gps_binary(const uint8_t *payload, uint8_t len) {
+	uint8_t msg[32] = { 0xa0, 0xa1, 0, len };
+	uint8_t checksum = 0;
+	for(int i = 0; i < len; i++) checksum ^= (msg[4 + i] = payload[i]);
+	msg[4 + len] = checksum;
+	msg[5 + len] = 0x0d;
+	msg[6 + len] = 0x0a;
+	gps_send(msg, len + 7, ACK_DELAY);
+}
+
+// A byte from the firmware
+static void gps_tx(avr_irq_t *irq, uint32_t value, void *param) {
+	if (tx_len == 0 && value != 0xa0) return;
+	tx[tx_len++] = value;
+	if (tx_len < 4) return;
+	uint8_t len = tx[3];
+	if (tx_len < len + 7u && tx_len < sizeof(tx)) return;
+	tx_len = 0;
+	const uint8_t *payload = tx + 4;
+	uint8_t checksum = 0;
+	for(int i = 0; i < len; i++) checksum ^= payload[i];
+	if (len < 2 || payload[len] != checksum) return;
+
+	uint8_t ack[] = { 0x83, payload[0], payload[1] };
+	gps_binary(ack, (payload[0] == 0x64)?3:2);
+	if (payload[0] == 0x08 && len >= 9) rmc_only = payload[5] && !payload[1] && !payload[2] && !payload[3] && !payload[6];
+	if (payload[0] != 0x64) return;
+	switch(payload[1]) {
+		case 0x15:
+			ref_year = (payload[3] << 8) | payload[4];
+			ref_mon = payload[5];
+			ref_day = payload[6];
+			break;
+		case 0x16:
+			{
+				uint8_t answer[] = { 0x64, 0x8a, 1, ref_year >> 8, ref_year, ref_mon, ref_day };
+				gps_binary(answer, sizeof(answer));
+			}
+			break;
+		case 0x1f:
+			leap_default = payload[2];
+			break;
+		case 0x20:
+			{
+				uint8_t answer[15] = { 0x64, 0x8e };
+				answer[12] = leap_default;
+				answer[13] = 17;
+				answer[14] = 1 << 2;
+				gps_binary(answer, sizeof(answer));
+			}
+			break;
+	}
+}
+
+static avr_cycle_count_t pps_end(avr_t *avr, avr_cycle_count_t when, void *param) {
+	avr_raise_irq(pps_pin, 0);
+	return 0;
+}
+
+static avr_cycle_count_t gps_second(avr_t *avr, avr_cycle_count_t when, void *param) {
+	pps_at = avr->cycle;
+	pps_pending = 1;
+	avr_raise_irq(pps_pin, 1);
+	avr_cycle_timer_register(avr, PPS_WIDTH, pps_end, NULL);
+
+	time_t t = START + sec++;
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	char body[96];
+	if (!rmc_only) {
+		snprintf(body, sizeof(body), "GPGGA,%02d%02d%02d.000,3723.2475,N,12158.3416,W,1,08,0.9,545.4,M,46.9,M,,",
+			tm.tm_hour, tm.tm_min, tm.tm_sec);
+		gps_nmea(body);
+		gps_nmea("GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1");
+		gps_nmea("GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00");
+		gps_nmea("GPGSV,3,2,11,14,25,170,00,16,57,208,39,18,67,296,40,19,40,246,00");
+		gps_nmea("GPGSV,3,3,11,22,42,067,42,24,14,311,43,27,05,244,00,,,,");
+	}
+	snprintf(body, sizeof(body), "GPRMC,%02d%02d%02d.000,A,3723.2475,N,12158.3416,W,0.01,180.80,%02d%02d%02d,,,D",
+		tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+	gps_nmea(body);
+	if (!rmc_only) gps_nmea("GPVTG,180.80,T,,M,0.01,N,0.02,K,D");
+	return when + second_cycles;
+}
+
+// Interrupt handlers starting (value 1) and returning (0)
+static void isr_running(avr_irq_t *irq, uint32_t value, void *param) {
+	int v = (int)(intptr_t)param;
+	if (value) {
+		isr_start[v] = avr->cycle;
+		if (v == TN841_PCINT0 && pps_pending) {
+			hist_add(&pps_hist, avr->cycle - pps_at);
+			pps_pending = 0;
+		}
+	} else if (isr_start[v]) {
+		avr_cycle_count_t took = avr->cycle - isr_start[v];
+		hist_add(&isr_hist[v], took);
+		isr_start[v] = 0;
+	}
+}
+
+// As in the firmware, by quarter
+static const struct {
+	const uint8_t *steps;
+	uint8_t length;
+} songs[] = {
+	{ hour_song, sizeof(hour_song) },
+	{ first_song, sizeof(first_song) },
+	{ second_song, sizeof(second_song) },
+	{ third_song, sizeof(third_song) },
+};
+
+// t is in ms from the first PPS.
+static void score_add(uint64_t t, uint8_t chord) {
+	for(int i = 0; i < CHANNELS; i++) {
+		if (!(chord & (1 << i))) continue;
+		score[score_len].at = START_CYCLE + (t - lead[i]) * second_cycles / 1000;
+		score[score_len++].chord = 1 << i;
+	}
+}
+
+static int cmp_due(const void *a, const void *b) {
+	const struct due *da = a, *db = b;
+	return (da->at > db->at) - (da->at < db->at);
+}
+
+// What ought to be struck in the run, as bench does it.
+static void make_score(uint32_t seconds) {
+	for(int q = 0; 180 + q * 900 <= seconds && score_len + 64 < sizeof(score) / sizeof(score[0]); q++) {
+		// The first quarter is 10:00 local.
+		uint16_t minute = (600 + q * 15) % 1440;
+		uint8_t hour = minute / 60;
+		if (minute < CHIME_START || minute > CHIME_END) continue;
+		const uint8_t *steps = songs[q % 4].steps;
+		uint8_t length = songs[q % 4].length;
+		uint64_t end = (180 + q * 900ULL) * 1000;
+		uint64_t t = end;
+		for(uint8_t i = 0; i < length; i++) t -= STEP_MS(steps[i]);
+		for(uint8_t i = 0; i < length; i++) {
+			score_add(t, STEP_CHORD(steps[i]));
+			t += STEP_MS(steps[i]);
+		}
+		if (q % 4 == 0) {
+			int count = (hour % 12)?hour % 12:12;
+			for(int i = 0; i < count; i++) score_add(end + i * 4000, 1 << 4);
+		}
+	}
+
+	// Channels that go on at the same moment make one chord.
+	qsort(score, score_len, sizeof(score[0]), cmp_due);
+	size_t n = 0;
+	for(size_t i = 0; i < score_len; i++) {
+		if (n && score[n - 1].at == score[i].at) score[n - 1].chord |= score[i].chord;
+		else score[n++] = score[i];
+	}
+	score_len = n;
+}
+
+// How many strikes were due before the end: one a channel, or one a
+// chord for synthesized bells.
+static uint64_t score_due(avr_cycle_count_t end, int synth) {
+	uint64_t n = 0;
+	for(size_t i = 0; i < score_len && score[i].at < end; i++)
+		n += synth?1:__builtin_popcount(score[i].chord);
+	return n;
+}
+
+// A strike on channel ch (CHANNELS for a synthesized chord, of any of
+// them), against the next one due on it.
+static void strike(uint8_t ch) {
+	uint8_t mask = (ch < CHANNELS)?1 << ch:0x1f;
+	size_t *pos = &(score_pos[ch]);
+	while (*pos < score_len && !(score[*pos].chord & mask)) (*pos)++;
+	strikes++;
+	if (*pos == score_len) {
+		unscored++;
+		return;
+	}
+	avr_cycle_count_t due = score[(*pos)++].at;
+	hist_add(&strike_hist, (avr->cycle > due)?avr->cycle - due:due - avr->cycle);
+}
+
+// Chime channels: CH0 = PA0, CH1 = PA3, CH2-4 = PB0-2
+static void chime_pin(avr_irq_t *irq, uint32_t value, void *param) {
+	uint8_t ch = (uint8_t)(intptr_t)param;
+	if (!value) {
+		pins &= ~(1 << ch);
+		return;
+	}
+	if (pins & (1 << ch)) return;
+	pins |= 1 << ch;
+	strike(ch);
+}
+
+// Whether the instruction at the PC writes TCNT0, with out or sts.
+static int writes_tcnt0(uint16_t op) {
+	if ((op & 0xf800) == 0xb800) return (((op >> 5) & 0x30) | (op & 0x0f)) + 0x20 == tn841_tcnt0;
+	if ((op & 0xfe0f) == 0x9200) return (avr->flash[avr->pc + 2] | (avr->flash[avr->pc + 3] << 8)) == tn841_tcnt0;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	uint32_t seconds = 3600;
+	double ppm = 0;
+	int synth = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:a")) != -1) {
+		switch(opt) {
+			case 's': seconds = strtoul(optarg, NULL, 10); break;
+			case 'p': ppm = strtod(optarg, NULL); break;
+			case 'a': synth = 1; break;
+			default: goto usage;
+		}
+	}
+	if (optind + 1 != argc) {
+usage:
+		fprintf(stderr, "usage: %s [-s seconds] [-p ppm] [-a] GPS_Chime_Clock.elf\n", argv[0]);
+		return 1;
+	}
+
+	elf_firmware_t f = { 0 };
+	if (elf_read_firmware(argv[optind], &f)) {
+		fprintf(stderr, "%s: can't load %s\n", argv[0], argv[optind]);
+		return 1;
+	}
+	avr = tn841_make();
+	if (avr == NULL || avr_init(avr)) {
+		fprintf(stderr, "%s: can't make an attiny841\n", argv[0]);
+		return 1;
+	}
+	f.frequency = F_CPU;
+	avr_load_firmware(avr, &f);
+	avr->log = LOG_WARNING;
+	if (synth) {
+		uint8_t output = 1;
+		avr_eeprom_desc_t ee = { .ee = &output, .offset = 9, .size = 1 };
+		avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+	}
+
+	uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), gps_tx, NULL);
+	// Don't echo what the firmware sends to stdout.
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+	pps_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), 7);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), 0), chime_pin, (void *)0);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), 3), chime_pin, (void *)1);
+	for(int i = 0; i < 3; i++)
+		avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i), chime_pin, (void *)(intptr_t)(i + 2));
+	for(int i = 0; i < TN841_VECTORS; i++)
+		avr_irq_register_notify(avr_get_interrupt_irq(avr, tn841_vectors[i]) + AVR_INT_IRQ_RUNNING, isr_running, (void *)(intptr_t)i);
+
+	second_cycles = F_CPU * (1 + ppm * 1e-6);
+	avr_cycle_timer_register(avr, START_CYCLE, gps_second, NULL);
+
+	// The leads, as the firmware reads them. Synthesized bells have none.
+	uint8_t cal[CHANNELS * 2];
+	avr_eeprom_desc_t ee = { .ee = cal, .offset = EE_CHIME_CAL, .size = sizeof(cal) };
+	avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
+	for(int i = 0; i < CHANNELS; i++) lead[i] = (cal[i * 2] == 0xff || synth)?0:cal[i * 2];
+	make_score(seconds);
+
+	avr_cycle_count_t end = (avr_cycle_count_t)seconds * F_CPU;
+	int state = cpu_Running;
+	while (avr->cycle < end && (state == cpu_Running || state == cpu_Sleeping)) {
+		// wdr is 0x95a8. The PC is a byte address.
+		uint16_t op = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+		if (op == 0x95a8) {
+			if (last_wdr && avr->cycle - last_wdr > wdr_gap) wdr_gap = avr->cycle - last_wdr;
+			last_wdr = avr->cycle;
+		}
+		if (synth && writes_tcnt0(op)) strike(CHANNELS);
+		if (avr->pc == 0 && avr->cycle > 0) resets++;
+		uint16_t sp = avr->data[tn841_spl] | (avr->data[tn841_spl + 1] << 8);
+		if (sp < sp_min) sp_min = sp;
+		state = avr_run(avr);
+	}
+
+	printf("%s under simavr, %u s at %+.0f ppm%s:\n", argv[optind], seconds, ppm, synth?", synthesized bells":"");
+	int over = 0;
+	over += hist_report(&pps_hist, synth?BUDGET_PPS + BUDGET_SAMPLE:BUDGET_PPS);
+	over += hist_report(&strike_hist, BUDGET_STRIKE);
+	for(int i = 0; i < TN841_VECTORS; i++) over += hist_report(&isr_hist[i], (synth && i == TN841_TIMER0_COMPA)?BUDGET_SAMPLE:0);
+	uint64_t due = score_due(end, synth);
+	printf("  longest between wdr %.1f ms (budget %.1f ms)%s, %u resets, %llu strikes of %llu due\n",
+		(double)wdr_gap / CYCLES_MS, BUDGET_WDR / 1000.0, (wdr_gap > BUDGET_WDR * CYCLES_US)?" OVER":"",
+		resets, (unsigned long long)strikes, (unsigned long long)due);
+	if (unscored) printf("  %llu strikes that weren't due\n", (unsigned long long)unscored);
+	printf("  deepest stack %u bytes\n", avr->ramend - sp_min);
+	if (state != cpu_Running && state != cpu_Sleeping) printf("  the CPU stopped (state %d)\n", state);
+	if (synth && isr_hist[TN841_TIMER0_COMPA].n == 0) printf("  no samples - was it built with FEATURES=-DWITH_SYNTH?\n");
+	over += wdr_gap > BUDGET_WDR * CYCLES_US;
+	over += resets != 0 || strikes == 0 || strikes != due || unscored != 0;
+	over += state != cpu_Running && state != cpu_Sleeping;
+	return over?1:0;
+}
@@ -0,0 +1,1081 @@
+/*
+
+    GPS Clock - host benchmark
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// Replays GPS receiver captures through the real receive and parse path
+// (USART0_RX_vect -> handleGPS() -> handle_time()) and times it, along with
+// the time zone calculation. The numbers are host nanoseconds, not AVR
+// cycles, so they're only good for comparing one build against another.
+//
+// The time zone rules are also checked against the C library's handling
+// of the equivalent POSIX TZ strings, for every change from 2000 to 2199.
+// Any disagreement makes the run fail.
+//
+// usage: bench [-s seconds] [-t trace file] [capture file ...]
+//
+// With no capture files, a synthetic one is made up: a typical 1 Hz
+// Skytraq NMEA burst (GGA, GSA, 3 x GSV, RMC, VTG) for the given number of
+// seconds (default one day) plus the binary reply to each hourly leap check.
+//
+// With -t, what the firmware sent during the event trace run is saved, for
+// host/tracedump.
+
+#define _DEFAULT_SOURCE
+
+#include "../GPS_Chime_Clock.c"
+#undef main
+
+#include "trace_decode.h"
+
+#include "tz_parse.h"
+#include "sim.h"
+
+static inline uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A growable byte buffer holding the capture
+static uint8_t *cap;
+static size_t cap_len, cap_size;
+
+static void cap_append(const void *data, size_t len) {
+	if (cap_len + len > cap_size) {
+		cap_size = (cap_size + len) * 2;
+		cap = realloc(cap, cap_size);
+		if (cap == NULL) { perror("realloc"); exit(1); }
+	}
+	memcpy(cap + cap_len, data, len);
+	cap_len += len;
+}
+
+static void cap_nmea(const char *body) {
+	// body is everything between the $ and the *
+	uint8_t checksum = 0;
+	for(const char *p = body; *p; p++) checksum ^= *p;
+	char line[128];
+	int len = snprintf(line, sizeof(line), "$%s*%02X\r\n", body, checksum);
+	cap_append(line, len);
+}
+
+static void load_capture(const char *fname) {
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) { perror(fname); exit(1); }
+	uint8_t buf[4096];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) cap_append(buf, n);
+	fclose(f);
+}
+
+static void synth_capture(uint32_t seconds) {
+	// Start a week before the 2nd Sunday of March 2016, so the US DST
+	// change is somewhere in a long enough run.
+	struct tm start = { .tm_year = 116, .tm_mon = 2, .tm_mday = 6 };
+	time_t t0 = timegm(&start);
+	char body[112];
+	for(uint32_t i = 0; i < seconds; i++) {
+		time_t t = t0 + i;
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		snprintf(body, sizeof(body), "GPGGA,%02d%02d%02d.000,3723.2475,N,12158.3416,W,1,08,0.9,545.4,M,46.9,M,,",
+			tm.tm_hour, tm.tm_min, tm.tm_sec);
+		cap_nmea(body);
+		cap_nmea("GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1");
+		cap_nmea("GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00");
+		cap_nmea("GPGSV,3,2,11,14,25,170,00,16,57,208,39,18,67,296,40,19,40,246,00");
+		cap_nmea("GPGSV,3,3,11,22,42,067,42,24,14,311,43,27,05,244,00,,,,");
+		snprintf(body, sizeof(body), "GPRMC,%02d%02d%02d.000,A,3723.2475,N,12158.3416,W,0.01,180.80,%02d%02d%02d,,,D",
+			tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+		cap_nmea(body);
+		cap_nmea("GPVTG,180.80,T,,M,0.01,N,0.02,K,D");
+		if (tm.tm_min == 30 && tm.tm_sec == 0) {
+			// reply to the leap check: 0x64-0x8e, current and default leap agree
+			uint8_t msg[] = { 0xa0, 0xa1, 0x00, 0x0f, 0x64, 0x8e, 0, 0, 0, 0, 0, 0, 0, 0, 0x07, 0xd0, 18, 18, 0x07, 0, 0x0d, 0x0a };
+			uint8_t checksum = 0;
+			for(int j = 4; j < 19; j++) checksum ^= msg[j];
+			msg[19] = checksum;
+			cap_append(msg, sizeof(msg));
+		}
+	}
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void report_latency(const char *name, uint32_t *samples, size_t n) {
+	if (n == 0) {
+		printf("  %-8s       none\n", name);
+		return;
+	}
+	qsort(samples, n, sizeof(*samples), cmp_u32);
+	uint64_t total = 0;
+	for(size_t i = 0; i < n; i++) total += samples[i];
+	printf("  %-8s %10zu  mean %6.0f  p50 %6u  p99 %6u  max %6u ns\n", name, n,
+		(double)total / n, samples[n / 2], samples[(n * 99) / 100], samples[n - 1]);
+}
+
+static void firmware_reset(void) {
+	// The same setup main() does, minus the hardware, with a blank EEPROM.
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	tz_load();
+	chime_synth = 0;
+	chime_cal_load();
+	utc_day = 0;
+	start_hour = 7;
+	end_hour = 22;
+	plan_day = 0xffffffff;
+	tx_pos = tx_len = 0;
+	cmd_pending = 0;
+	cmd_current = CMD_NONE;
+	memset(cmd_tries, 0, sizeof(cmd_tries));
+	rx_slot = 0;
+	rx_parse_slot = 0;
+	for(int i = 0; i < RX_SLOTS; i++) rx_msg[i].type = MSG_NONE;
+	gps_locked = 0;
+	pps_counting = 0;
+	pps_agreed = 0;
+	gps_time_wanted = 1;
+	rx_phase = 0;
+	rx_phase_rejects = 0;
+	rx_ahead = 0;
+	rx_mismatched = 0;
+	gps_mode = GPS_NMEA;
+	gps_save = 0;
+	uart_fast = 0;
+	sync_role = SYNC_NONE;
+	sync_due = 0;
+	sync_fresh = 0;
+	gps_binary = 0;
+	gps_rmc_only = 0;
+	gps_chatty = 0;
+	gps_leap = 0xff;
+	rx_ignored = 0;
+	trace_pos = 0;
+	trace_dump_asked = 0;
+	trace_dump_pos = TRACE_DUMP_END;
+	memset(&stats, 0, sizeof(stats));
+	utc_ref_year = 0;
+	ticks = 1;
+	tick_rate = tick_len = TICK_NOMINAL;
+	tick_recip = 0xffffffffUL / TICK_NOMINAL;
+	tick_count = 0;
+	tick_count_frac = 0;
+	timer_high = 0;
+	TCNT2 = 0;
+	solenoids_on = 0;
+	TIMSK0 = 0;
+	sim_tx_bytes = 0;
+}
+
+// Latency samples, split by message type
+static uint32_t *lat_rmc, *lat_bin;
+static size_t n_rmc, n_bin;
+static uint32_t seconds_seen;
+
+// Feed the whole capture through the receive ISR and handleGPS() the way
+// main() does. If timed, record the time from the ISR call for each
+// message's final byte through to handleGPS() returning.
+static void replay(int timed) {
+	uint8_t last_second = 0xff;
+	uint64_t t = 0;
+
+	n_rmc = n_bin = 0;
+	seconds_seen = 0;
+	for(size_t i = 0; i < cap_len; i++) {
+		if (timed) t = now_ns();
+		UDR0 = cap[i];
+		USART0_RX_vect();
+		volatile struct gps_msg *msg = &(rx_msg[rx_parse_slot]);
+		if (msg->type == MSG_NONE) continue;
+
+		uint8_t type = msg->type;
+		handleGPS((const struct gps_msg *)msg);
+		msg->type = MSG_NONE;
+		if (++rx_parse_slot == RX_SLOTS) rx_parse_slot = 0;
+
+		if (timed) {
+			uint32_t elapsed = (uint32_t)(now_ns() - t);
+			if (type == MSG_RMC) lat_rmc[n_rmc++] = elapsed;
+			else lat_bin[n_bin++] = elapsed;
+		}
+		if (second != last_second) {
+			seconds_seen++;
+			last_second = second;
+		}
+	}
+}
+
+static void bench_parse(void) {
+	size_t lines = 0;
+	for(size_t i = 0; i < cap_len; i++) lines += cap[i] == '$' || cap[i] == 0xa0;
+
+	firmware_reset();
+	uint64_t start = now_ns();
+	replay(0);
+	uint64_t total_ns = now_ns() - start;
+
+	printf("parse: %zu bytes, %zu lines, %u time updates, %llu bytes sent to receiver\n",
+		cap_len, lines, seconds_seen, (unsigned long long)sim_tx_bytes);
+	printf("  %.0f lines/s, %.1f ns/byte through USART0_RX_vect + handleGPS()\n",
+		lines * 1e9 / total_ns, (double)total_ns / cap_len);
+	printf("  %u dropped with every slot full, %u too long, %u bad checksums\n", stats.rx_overruns, stats.rx_overflows, stats.rx_checksum_errors);
+	printf("  final local time %02d:%02d:%02d, %s\n", hour, minute, second, gps_locked?"locked":"unlocked");
+
+	// There can't be more messages than there are lines in the capture.
+	lat_rmc = malloc((lines + 1) * sizeof(uint32_t));
+	lat_bin = malloc((lines + 1) * sizeof(uint32_t));
+	firmware_reset();
+	replay(1);
+	printf("latency from the final byte through handleGPS():\n");
+	report_latency("RMC", lat_rmc, n_rmc);
+	report_latency("binary", lat_bin, n_bin);
+	free(lat_rmc);
+	free(lat_bin);
+}
+
+// A sentence cut short by the next one's "$" mustn't take that one down too.
+static int bench_cut(void) {
+	const char *body = "GPRMC,120001.000,A,3723.2475,N,12158.3416,W,0.01,180.80,060316,,,D";
+	uint8_t checksum = 0;
+	for(const char *p = body; *p; p++) checksum ^= *p;
+	char line[128];
+	snprintf(line, sizeof(line), "$GPRMC,120000.000,A,3723.24$%s*%02X\r\n", body, checksum);
+
+	firmware_reset();
+	for(const char *p = line; *p; p++) {
+		UDR0 = *p;
+		USART0_RX_vect();
+	}
+	volatile struct gps_msg *msg = &(rx_msg[rx_parse_slot]);
+	int ok = msg->type == MSG_RMC && msg->rmc.status == 'A' && msg->rmc.h == 12 && msg->rmc.min == 0 && msg->rmc.s == 1;
+	printf("a sentence cut off by a \"$\": the next one %s\n", ok?"parsed":"lost");
+	return !ok;
+}
+
+// Zones to check, either with a built-in rule (dst_mode and the EEPROM
+// timezone) or a custom one, against the equivalent TZ string.
+static const struct {
+	uint8_t dst_mode;
+	int8_t tz_hour;
+	const char *tz;
+} zones[] = {
+	{ DST_US, -8, "PST8PDT,M3.2.0,M11.1.0" },
+	{ DST_US, -5, "EST5EDT,M3.2.0,M11.1.0" },
+	{ DST_EU, 0, "GMT0BST,M3.5.0/1,M10.5.0" },
+	{ DST_EU, 1, "CET-1CEST,M3.5.0,M10.5.0/3" },
+	{ DST_EU, 2, "EET-2EEST,M3.5.0/3,M10.5.0/4" },
+	{ DST_AU, 10, "AEST-10AEDT,M10.1.0,M4.1.0/3" },
+	{ DST_NZ, 12, "NZST-12NZDT,M9.5.0,M4.1.0/3" },
+	{ DST_OFF, 9, "JST-9" },
+	{ DST_CUSTOM, 0, "NST3:30NDT,M3.2.0,M11.1.0" },
+	{ DST_CUSTOM, 0, "<+1030>-10:30<+11>-11,M10.1.0,M4.1.0" },
+	{ DST_CUSTOM, 0, "<+1245>-12:45<+1345>,M9.5.0/2:45,M4.1.0/3:45" },
+	{ DST_CUSTOM, 0, "<-04>4<-03>,M9.1.6/24,M4.1.6/24" },
+	{ DST_CUSTOM, 0, "IST-5:30" },
+};
+
+static long ref_offset(time_t t) {
+	struct tm tm;
+	localtime_r(&t, &tm);
+	return tm.tm_gmtoff;
+}
+
+static int cmp_time(const void *a, const void *b) {
+	time_t x = *(const time_t *)a, y = *(const time_t *)b;
+	return (x > y) - (x < y);
+}
+
+#define CHECK_START (946684800) // 2000-01-01
+#define CHECK_END (7258118400) // 2200-01-01
+#define CHECK_DAYS ((CHECK_END - CHECK_START) / 86400)
+
+// Feed RMC times through handle_time() the way handleGPS() does, in order:
+// one at a varying time every day, and the two seconds either side of
+// every change the C library knows about. Returns the number of wrong
+// local times.
+static int check_zone(int z) {
+	static time_t samples[CHECK_DAYS + 1024];
+	size_t n = 0;
+	int changes = 0, errors = 0;
+
+	setenv("TZ", zones[z].tz, 1);
+	tzset();
+	long off = ref_offset(CHECK_START);
+	for(time_t t = CHECK_START; t < CHECK_END; t += 86400) {
+		samples[n++] = t + (((t - CHECK_START) / 86400) * 7919) % 86400;
+		long new_off = ref_offset(t);
+		if (new_off == off) continue;
+		time_t lo = t - 86400, hi = t;
+		while (hi - lo > 1) {
+			time_t mid = lo + (hi - lo) / 2;
+			if (ref_offset(mid) == off) lo = mid;
+			else hi = mid;
+		}
+		// handle_time() is given the second before the one it works out.
+		samples[n++] = hi - 2;
+		samples[n++] = hi - 1;
+		off = new_off;
+		changes++;
+	}
+	qsort(samples, n, sizeof(samples[0]), cmp_time);
+
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	eeprom_write_byte(EE_DST_MODE, zones[z].dst_mode);
+	eeprom_write_byte(EE_TIMEZONE, zones[z].tz_hour + 12);
+	if (zones[z].dst_mode == DST_CUSTOM) {
+		struct tz_rule rule;
+		if (tz_parse(zones[z].tz, &rule)) {
+			printf("  %s: can't parse\n", zones[z].tz);
+			return 1;
+		}
+		for(size_t i = 0; i < sizeof(rule); i++) eeprom_write_byte((uint8_t *)EE_TZ_RULE + i, ((uint8_t *)&rule)[i]);
+	}
+	tz_load();
+	utc_day = 0;
+
+	for(size_t i = 0; i < n; i++) {
+		struct tm utc, local;
+		time_t next = samples[i] + 1;
+		gmtime_r(&(samples[i]), &utc);
+		localtime_r(&next, &local);
+		handle_time(utc.tm_hour, utc.tm_min, utc.tm_sec, utc.tm_mday, utc.tm_mon + 1, utc.tm_year + 1900);
+		if (hour == local.tm_hour && minute == local.tm_min && second == local.tm_sec) continue;
+		if (errors++ < 5) {
+			printf("  %s: %04d-%02d-%02d %02d:%02d:%02d UTC is %02d:%02d:%02d, not %02d:%02d:%02d\n", zones[z].tz,
+				utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec + 1,
+				local.tm_hour, local.tm_min, local.tm_sec, hour, minute, second);
+		}
+	}
+	printf("  %-44s %4d changes %6zu times  %s\n", zones[z].tz, changes, n, errors?"FAIL":"ok");
+	return errors;
+}
+
+static int bench_tz(void) {
+	int errors = 0;
+	printf("time zone rules vs. the C library, 2000-2199:\n");
+	for(size_t z = 0; z < sizeof(zones) / sizeof(zones[0]); z++) errors += check_zone(z);
+
+	// The per-second cost, over a year in the default zone
+	firmware_reset();
+	uint32_t calls = 0;
+	uint64_t start = now_ns();
+	for(time_t t = 1451606400; t < 1483228800; t++, calls++) { // 2016
+		struct tm utc;
+		gmtime_r(&t, &utc);
+		handle_time(utc.tm_hour, utc.tm_min, utc.tm_sec, utc.tm_mday, utc.tm_mon + 1, utc.tm_year + 1900);
+	}
+	uint64_t with_gmtime = now_ns() - start;
+	// and gmtime_r()'s share of that, timed on its own. The two loops are
+	// close enough that noise can make the difference negative.
+	volatile int sink = 0;
+	start = now_ns();
+	for(time_t t = 1451606400; t < 1483228800; t++) {
+		struct tm utc;
+		gmtime_r(&t, &utc);
+		sink += utc.tm_sec;
+	}
+	uint64_t gmtime_only = now_ns() - start;
+	int64_t elapsed = (int64_t)with_gmtime - (int64_t)gmtime_only;
+	if (elapsed < 0) elapsed = 0;
+	printf("  handle_time() %.1f ns/call (%.1f with gmtime_r(), %.1f for gmtime_r() alone)\n", (double)elapsed / calls,
+		(double)with_gmtime / calls, (double)gmtime_only / calls);
+
+	volatile uint32_t sink32 = 0;
+	calls = 0;
+	start = now_ns();
+	for(uint16_t y = 2000; y < 2200; y++) {
+		for(uint32_t m = 0; m < 12; m++, calls++) {
+			tz_update(days_since_2000(y, m + 1, 15) * 1440, y);
+			sink32 += tz_next_change;
+		}
+	}
+	printf("  tz_update()   %.1f ns/call (once a day, and at each change)\n", (double)(now_ns() - start) / calls);
+	(void)sink;
+	(void)sink32;
+	return errors;
+}
+
+static void bench_chime(void) {
+	// Strike the hour song plus twelve o'clock the way main() does, and see
+	// how long each strike holds up the main loop and how long the solenoid
+	// stays on.
+	const size_t steps = sizeof(hour_song) / sizeof(hour_song[0]);
+	uint32_t samples[steps + 12];
+	size_t n = 0;
+	uint32_t stall_ticks = 0;
+	uint16_t pulse_min = UINT16_MAX, pulse_max = 0;
+
+	for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		uint8_t chord = (i < steps)?STEP_CHORD(hour_song[i]):_BV(4);
+		if (chord == 0) continue;
+		uint32_t before = timer_value();
+		uint64_t t = now_ns();
+		do_chord(chord);
+		samples[n++] = (uint32_t)(now_ns() - t);
+		stall_ticks += timer_value() - before;
+
+		// Run the timer from one compare match to the next.
+		uint16_t start = TCNT2;
+		while (solenoids_on) {
+			TCNT2 = OCR2A;
+			TIMER2_COMPA_vect();
+		}
+		uint16_t pulse = TCNT2 - start;
+		if (pulse < pulse_min) pulse_min = pulse;
+		if (pulse > pulse_max) pulse_max = pulse;
+		if ((PORTA & chord_porta(0x1f)) || (PORTB & chord_portb(0x1f))) {
+			printf("chime: solenoid left on!\n");
+			exit(1);
+		}
+	}
+	printf("do_chord() main loop stall, %zu strikes, %u ticks total:\n", n, stall_ticks);
+	report_latency("strike", samples, n);
+	printf("  solenoid released by TIMER2_COMPA_vect after %u-%u counts (%.2f-%.2f ms)\n", pulse_min, pulse_max,
+		pulse_min * 0.032, pulse_max * 0.032);
+}
+
+// Set the timer to where it would be at a true time (s).
+static void bench_timer_at(double sec, double count_time) {
+	uint32_t count = sec / count_time;
+	timer_high = count >> 16;
+	TCNT2 = count;
+}
+
+// Run the timer against an oscillator that's off by ppm, with a PPS edge
+// every true second, keeping ticks up to date and calling pps_place() and
+// pps_discipline() the way main() does. Report how well the tick grid ends
+// up lined up with the PPS.
+static void bench_pps(double ppm) {
+	const uint32_t seconds = 600, settle = 60;
+	static uint32_t phase[600];
+	size_t n = 0;
+	double count_time = 1.0 / (31250.0 * (1 + ppm * 1e-6)); // seconds per timer count
+	double ref_ms = 0;
+	double worst_drift = 0;
+
+	firmware_reset();
+	for(uint32_t sec = 1; sec <= seconds; sec++) {
+		for(uint32_t ms = 0; ms < 1000; ms += TICK_WAKE_MAX) {
+			bench_timer_at(sec - 1 + ms / 1000.0, count_time);
+			timer_value();
+		}
+		bench_timer_at(sec, count_time);
+		PINA |= _BV(7);
+		PCINT0_vect();
+		PINA &= ~_BV(7);
+		timer_value();
+		pps_place();
+
+		// How far the PPS is from the nearest tick boundary, going by the
+		// tick lengths in use up to now
+		double len = tick_len / 65536.0;
+		double into = sec / count_time - (tick_count + tick_count_frac / 65536.0);
+		double at_ms = ticks + into / len;
+		into = fmod(into + 16 * len, len);
+		double err = ((into < len / 2)?into:len - into) * count_time;
+		pps_discipline();
+
+		if (sec < settle) continue;
+		phase[n++] = (uint32_t)(err * 1e6);
+		// How far the tick count has wandered from whole seconds
+		if (sec == settle) ref_ms = at_ms;
+		double drift = fabs(at_ms - ref_ms - 1000.0 * (sec - settle));
+		if (drift > worst_drift) worst_drift = drift;
+	}
+	qsort(phase, n, sizeof(phase[0]), cmp_u32);
+	printf("  %+6.0f ppm: estimated %+6d ppm, PPS to tick boundary p50 %3u p99 %3u max %3u us, worst drift %.2f ms\n",
+		ppm, stats.osc_ppm, phase[n / 2], phase[(n * 99) / 100], phase[n - 1], worst_drift);
+}
+
+// 2016-05-26 16:57:00 UTC is 09:57:00 PDT, three minutes before the hour.
+#define SCORE_START (1464281820)
+
+// What ought to be struck in the first so many seconds after SCORE_START,
+// in true time: the song for each quarter, ending on the quarter, and the
+// hour after each hour song, in the chiming hours for that (local) day -
+// by default 7:00 to 22:59. Each channel is energized early by its lead
+// time, so the score is of when the pins ought to go on.
+static struct sim_strike score[4096];
+static size_t score_len;
+// The chiming hours on Thursday (the day it starts) and Friday
+static struct chime_sched score_sched[2];
+
+static void score_sched_default(void) {
+	for(int i = 0; i < 2; i++) {
+		score_sched[i].start = 7 * 60;
+		score_sched[i].end = 22 * 60 + 59;
+	}
+}
+
+static void score_add(uint64_t t, uint8_t chord) {
+	for(int i = 0; i < CHANNELS; i++) {
+		if (!(chord & _BV(i))) continue;
+		score[score_len].t = t - chime_cal[i].lead * 1000000ULL;
+		score[score_len++].chord = _BV(i);
+	}
+}
+
+static int cmp_strike(const void *a, const void *b) {
+	const struct sim_strike *sa = a, *sb = b;
+	return (sa->t > sb->t) - (sa->t < sb->t);
+}
+
+static void make_score(uint32_t seconds) {
+	score_len = 0;
+	for(int q = 0; 180 + q * 900 <= seconds; q++) {
+		// The first quarter is 10:00 local.
+		uint16_t minute = 600 + q * 15;
+		uint8_t hour = minute / 60 % 24;
+		if (!sched_chimes(&score_sched[minute / 1440], minute % 1440)) continue;
+		const uint8_t *steps = songs[q % 4].steps;
+		uint8_t length = songs[q % 4].length;
+		uint64_t end = 180 + q * 900ULL;
+		uint64_t t = end * SIM_NS - song_duration(steps, length) * 1000000ULL;
+		for(uint8_t i = 0; i < length; i++) {
+			score_add(t, STEP_CHORD(steps[i]));
+			t += STEP_MS(steps[i]) * 1000000ULL;
+		}
+		if (q % 4 == 0) {
+			int strikes = (hour % 12)?hour % 12:12;
+			for(int i = 0; i < strikes; i++) score_add((end + i * 4) * SIM_NS, _BV(4));
+		}
+	}
+
+	// Channels that go on at the same moment make one chord.
+	qsort(score, score_len, sizeof(score[0]), cmp_strike);
+	size_t n = 0;
+	for(size_t i = 0; i < score_len; i++) {
+		if (n && score[n - 1].t == score[i].t) score[n - 1].chord |= score[i].chord;
+		else score[n++] = score[i];
+	}
+	score_len = n;
+}
+
+// Compare the last run's strikes with the score. Returns the worst error
+// in us, or -1 if the strikes aren't the ones in the score.
+static int64_t check_score(void) {
+	if (sim.n_strikes != score_len) return -1;
+	int64_t worst = 0;
+	for(size_t i = 0; i < score_len; i++) {
+		if (sim.strikes[i].chord != score[i].chord) return -1;
+		int64_t err = llabs((int64_t)(sim.strikes[i].t - score[i].t)) / 1000;
+		if (err > worst) worst = err;
+	}
+	return worst;
+}
+
+// The receiver loses its fix (and the PPS) for six minutes across the top
+// of the hour.
+static uint8_t gps_dropout(uint32_t sec) {
+	if (sec >= 120 && sec < 480) return SIM_RMC | SIM_ACK;
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK;
+}
+
+static void bench_holdover(uint8_t window) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	eeprom_write_byte(EE_HOLDOVER, window);
+	sim_run(SCORE_START, 600, 5000, gps_dropout);
+	make_score(600);
+	int64_t worst = check_score();
+
+	printf("  %u hour window: %zu strikes", window, sim.n_strikes);
+	if (worst >= 0) printf(", worst %lld us from the score", (long long)worst);
+	printf("\n    %u s in holdover, %+d ms off when the PPS came back\n", stats.holdover_seconds, stats.holdover_drift_ms);
+}
+
+// The receiver has a good fix the whole time.
+static uint8_t gps_good(uint32_t sec) {
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK;
+}
+
+// Every song ought to end right on its quarter, and every note in it ought
+// to be where the song says. With a calibration table, each channel ought
+// to go on early by its lead time and stay on for its own pulse width.
+static int bench_songs(const struct chime_cal *cal) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	if (cal != NULL) {
+		for(size_t i = 0; i < sizeof(chime_cal); i++)
+			eeprom_write_byte((uint8_t *)EE_CHIME_CAL + i, ((const uint8_t *)cal)[i]);
+	}
+	sim_run(SCORE_START, 3600, 0, gps_good);
+	make_score(3600);
+	int64_t worst = check_score();
+
+	printf("  %s: %zu strikes, ", (cal == NULL)?"uncalibrated":"calibrated", sim.n_strikes);
+	if (worst < 0) {
+		printf("not the %zu in the score\n", score_len);
+		return 1;
+	}
+	printf("worst %lld us from the score, pulses", (long long)worst);
+	int errors = worst > 2000;
+	for(int i = 0; i < CHANNELS; i++) {
+		double lo = sim.pulse_min[i] / 1e6, hi = sim.pulse_max[i] / 1e6;
+		printf(" %.0f-%.0f", lo, hi);
+		if (lo < chime_cal[i].pulse - 1.1 || hi > chime_cal[i].pulse + 1.1) errors++;
+	}
+	printf(" ms\n");
+	return errors;
+}
+
+// How much of a frequency there is in the samples
+static double goertzel(const int16_t *x, size_t n, double hz) {
+	double w = 2 * cos(2 * M_PI * hz / SYNTH_RATE), s1 = 0, s2 = 0;
+	for(size_t i = 0; i < n; i++) {
+		double s0 = x[i] + w * s1 - s2;
+		s2 = s1;
+		s1 = s0;
+	}
+	return s1 * s1 + s2 * s2 - w * s1 * s2;
+}
+
+// The synthesized bells. Each voice by itself ought to be strongest at its
+// note and die away in SYNTH_SILENT steps of SYNTH_DECAY samples. Then the
+// songs played on them ought to start each note a sample after the score
+// says, which is less than a strike is allowed to be late on real hardware.
+static int bench_synth(void) {
+	static const struct {
+		const char *name;
+		double hz;
+	} notes[CHANNELS] = { { "B3", 246.94 }, { "E4", 329.63 }, { "F#4", 369.99 }, { "G#4", 415.30 }, { "E3", 164.81 } };
+	static int16_t wave[SYNTH_RATE / 2];
+	const double silent = (double)SYNTH_SILENT * SYNTH_DECAY / SYNTH_RATE;
+	int errors = 0;
+
+	printf("synthesized bells, %u samples/s:\n", SYNTH_RATE);
+	synth_init();
+	for(int i = 0; i < CHANNELS; i++) {
+		synth_strike(_BV(i));
+		size_t n = 0;
+		int peak = 0;
+		while (TIMSK0 & _BV(OCIE0A)) {
+			TIMER0_COMPA_vect();
+			int16_t v = OCR1A - SYNTH_MID;
+			if (n < sizeof(wave) / sizeof(wave[0])) wave[n] = v;
+			if (abs(v) > peak) peak = abs(v);
+			n++;
+		}
+		// The strongest frequency in the first half second, to 1 Hz and then
+		// to 0.01 Hz.
+		double best = 0, power = 0;
+		for(double f = 50; f < SYNTH_RATE / 2; f += 1) {
+			double p = goertzel(wave, sizeof(wave) / sizeof(wave[0]), f);
+			if (p > power) {
+				power = p;
+				best = f;
+			}
+		}
+		for(double f = best - 1; f < best + 1; f += 0.01) {
+			double p = goertzel(wave, sizeof(wave) / sizeof(wave[0]), f);
+			if (p > power) {
+				power = p;
+				best = f;
+			}
+		}
+		double took = (double)n / SYNTH_RATE;
+		printf("  %-3s %6.2f Hz: strongest at %6.2f Hz, peak %3d, silent after %.2f s\n", notes[i].name, notes[i].hz,
+			best, peak, took);
+		if (fabs(best - notes[i].hz) > notes[i].hz / 500 || took < silent * 0.9 || took > silent * 1.1) errors++;
+	}
+
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	eeprom_write_byte(EE_OUTPUT, 1);
+	sim_run(SCORE_START, 3600, 0, gps_good);
+	make_score(3600);
+	int64_t worst = check_score();
+	printf("  songs, an hour with a fix: %zu notes, ", sim.n_strikes);
+	if (worst < 0) {
+		printf("not the %zu in the score\n", score_len);
+		return errors + 1;
+	}
+	printf("worst %lld us from the score, %llu of %llu samples clipped\n", (long long)worst,
+		(unsigned long long)sim.samples_clipped, (unsigned long long)sim.sample_isrs);
+	printf("  sounding %.0f s of the hour, active %.2f%% estimated\n", (double)sim.sample_isrs / SYNTH_RATE,
+		100 * sim_duty());
+	return errors + (worst > 250);
+}
+
+// A whole day, all of it driven by the event queue: every strike ought to
+// be where the score says, and the leap second check ought to go out at
+// half past every hour, without the queue ever running out of room.
+static int bench_day(void) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	sim_run(SCORE_START, 86400, 0, gps_good);
+	make_score(86400);
+	int64_t worst = check_score();
+	int leap_checks = 0, late_checks = 0;
+	for(size_t i = 0; i < sim.n_cmds; i++) {
+		if (sim.cmds[i].id != 0x20) continue;
+		leap_checks++;
+		// 16:57:00 plus the time of the command ought to be on a half hour.
+		uint64_t into = (sim.cmds[i].t + 27 * 60 * SIM_NS) % (3600 * SIM_NS);
+		if (into > SIM_NS) late_checks++;
+	}
+
+	printf("a day with a fix, from the event queue:\n  %zu strikes, ", sim.n_strikes);
+	if (worst < 0) printf("not the %zu in the score", score_len);
+	else printf("worst %lld us from the score", (long long)worst);
+	printf(", %d leap checks (%d not on the half hour), %u events dropped\n", leap_checks, late_checks, stats.event_overflows);
+	return worst < 0 || worst > 2000 || leap_checks != 24 || late_checks || stats.event_overflows;
+}
+
+// Chiming hours by the day of the week: Thursday from 21:30 until 00:30,
+// which wraps around midnight (but Friday's midnight goes by Friday), and
+// Friday from 8:00 until 8:30 - which chimes at 8:30, but not at 8:45.
+static int bench_plan(void) {
+	static const struct chime_sched thursday = { 21 * 60 + 30, 30 }, friday = { 8 * 60, 8 * 60 + 30 };
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	for(size_t i = 0; i < sizeof(thursday); i++) {
+		eeprom_write_byte((uint8_t *)EE_SCHEDULE + 4 * sizeof(thursday) + i, ((const uint8_t *)&thursday)[i]);
+		eeprom_write_byte((uint8_t *)EE_SCHEDULE + 5 * sizeof(friday) + i, ((const uint8_t *)&friday)[i]);
+	}
+	sim_run(SCORE_START, 86400, 0, gps_good);
+	score_sched[0] = thursday;
+	score_sched[1] = friday;
+	make_score(86400);
+	score_sched_default();
+	int64_t worst = check_score();
+
+	printf("  weekday schedules: %zu strikes, ", sim.n_strikes);
+	if (worst < 0) printf("not the %zu in the score\n", score_len);
+	else printf("worst %lld us from the score\n", (long long)worst);
+	return worst < 0 || worst > 2000;
+}
+
+// Once the firmware trusts the PPS, it ought to count seconds from that
+// alone, and only look at the receiver's time every PPS_CHECK seconds.
+static int bench_counting(void) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	sim_run(SCORE_START, 3600, 0, gps_good);
+	make_score(3600);
+	int64_t worst = check_score();
+
+	printf("seconds from the PPS alone:\n  an hour with a fix: %u of 3600 counted, %u checks, %u disagreements, ",
+		stats.pps_counted, stats.pps_checks, stats.pps_check_fails);
+	if (worst < 0) printf("not the %zu in the score\n", score_len);
+	else printf("worst %lld us from the score\n", (long long)worst);
+	return worst < 0 || worst > 2000 || stats.pps_counted < 3500 || stats.pps_check_fails;
+}
+
+// The receiver's time jumps a second ahead of its PPS a minute in.
+static uint32_t step_caught;
+
+static uint8_t gps_step(uint32_t sec) {
+	if (stats.pps_check_fails && !step_caught) step_caught = sec;
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK | ((sec >= 60)?SIM_STEP:0);
+}
+
+// The firmware ought to notice at the next check, take the receiver's time,
+// and go back to counting once it's agreed for PPS_AGREE seconds.
+static int bench_step(void) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	step_caught = 0;
+	sim_run(SCORE_START, 120, 0, gps_step);
+	time_t told = SCORE_START + 120;
+	struct tm tm;
+	gmtime_r(&told, &tm);
+	uint8_t followed = utc_hour == tm.tm_hour && utc_minute == tm.tm_min && utc_second == tm.tm_sec;
+
+	printf("  a step a minute in: %u disagreements, ", stats.pps_check_fails);
+	if (step_caught) printf("caught %u s later, ", step_caught - 60);
+	else printf("never caught, ");
+	printf("%s, %s\n", followed?"followed":"not followed", pps_counting?"counting again":"not counting");
+	return stats.pps_check_fails != 1 || !step_caught || step_caught - 60 > PPS_CHECK + 1 || !followed || !pps_counting;
+}
+
+// The receiver loses its fix (but not its PPS) for 10 s, starting between
+// two checks. This is called before each second's PPS, so it sees whether
+// the firmware counted the second before.
+static uint32_t lost_caught;
+
+static uint8_t gps_lost(uint32_t sec) {
+	if (sec >= 63 && !pps_counting && !lost_caught) lost_caught = sec;
+	return SIM_PPS | SIM_RMC | SIM_ACK | ((sec >= 63 && sec < 73)?0:SIM_FIX);
+}
+
+// The RMCs in between checks still say so, so counting ought to stop at
+// the next second, and start again once the fix is back.
+static int bench_lost(void) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	lost_caught = 0;
+	sim_run(SCORE_START, 90, 0, gps_lost);
+
+	printf("  fix lost between checks: ");
+	if (lost_caught) printf("stopped counting %u s later, ", lost_caught - 64);
+	else printf("never stopped counting, ");
+	printf("%s\n", pps_counting?"counting again":"not counting");
+	return !lost_caught || lost_caught - 64 > 1 || !pps_counting;
+}
+
+// A 10 Hz receiver, whose labels between seconds ought to be ignored
+static uint8_t gps_tenths(uint32_t sec) {
+	sim.out_hz = 10;
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK;
+}
+
+// A receiver that labels the edge to come, late in the second before it
+static uint8_t gps_ahead(uint32_t sec) {
+	sim.out_delay = SIM_NS * 85 / 100;
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK | SIM_STEP;
+}
+
+// Every half minute, the label for second 10 is half a second late, and
+// the one for second 19 is held up past the next PPS - after which the
+// receiver skips a second to catch up.
+static uint8_t gps_held_up(uint32_t sec) {
+	if (sec % 30 == 10) sim.out_delay = SIM_RMC_DELAY + SIM_NS / 2;
+	else if (sec % 30 == 19) sim.out_delay = SIM_RMC_DELAY + SIM_NS;
+	else sim.out_delay = SIM_RMC_DELAY;
+	if (sec % 30 == 20) return SIM_PPS | SIM_FIX | SIM_ACK;
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK;
+}
+
+// Whichever way the receiver lines its labels up with the PPS, the firmware
+// ought to learn it and strike right on the score. Held up labels ought to
+// be ignored (and counted) without knocking it out of counting seconds.
+static int bench_labels(const char *name, uint8_t mode, uint8_t (*gps)(uint32_t sec), uint8_t ahead) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	eeprom_write_byte(EE_GPS_MODE, mode);
+	sim_run(SCORE_START, 600, 0, gps);
+	make_score(600);
+	int64_t worst = check_score();
+
+	printf("  %-15s: phase %3.0f ms, %s, %u late, %u mismatched, %u disagreements, ", name,
+		rx_phase * TRACE_COUNT_MS, rx_ahead?"edge to come":"edge gone", stats.rx_late, stats.rx_mismatches, stats.pps_check_fails);
+	if (worst < 0) printf("not the %zu in the score\n", score_len);
+	else printf("worst %lld us from the score\n", (long long)worst);
+	int errors = worst < 0 || worst > 2000 || rx_ahead != ahead || stats.pps_check_fails;
+	if (gps == gps_held_up && (stats.rx_late == 0 || stats.rx_mismatches == 0)) errors++;
+	return errors;
+}
+
+// The receiver doesn't answer commands for the first 20 seconds.
+static uint8_t gps_deaf(uint32_t sec) {
+	return SIM_PPS | SIM_RMC | SIM_FIX | ((sec >= 20)?SIM_ACK:0);
+}
+
+static void report_cmds(const char *name, time_t start) {
+	printf("  %s:", name);
+	for(size_t i = 0; i < sim.n_cmds; i++) {
+		time_t t = start + sim.cmds[i].t / SIM_NS;
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		printf("%s %02x@%02d:%02d:%02d.%03u", (i % 6)?",":(i?"\n   ":""), sim.cmds[i].id, tm.tm_hour, tm.tm_min, tm.tm_sec,
+			(unsigned)(sim.cmds[i].t % SIM_NS / 1000000));
+	}
+	printf("\n    %u given up, %u NACKs, %u unasked answers, reference date %u-%02u-%02u, leap default %u\n",
+		stats.cmd_failures, stats.cmd_nacks, stats.cmd_unsolicited, sim.ref_year, sim.ref_mon, sim.ref_day, sim.leap_default);
+}
+
+// The firmware ought to cut the receiver's output down to RMC and fetch its
+// UTC reference date at startup, and then set that to this year, and fix
+// the leap second default at half past the hour. If the receiver isn't
+// answering, it ought to back off.
+static int bench_cmds(void) {
+	int errors = 0;
+	printf("receiver commands (UTC):\n");
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	sim_run(SCORE_START, 3600, 0, gps_good);
+	report_cmds("answering", SCORE_START);
+	if (sim.n_cmds != 5 || sim.ref_year != 2016 || sim.leap_default != 17 || stats.cmd_failures) errors++;
+
+	sim_run(SCORE_START, 120, 0, gps_deaf);
+	report_cmds("deaf for 20 s", SCORE_START);
+	// Four tries, backing off 2, 4, 8 and 16 s after each, then an answer
+	// and the rest go through
+	if (sim.n_cmds != 7 || sim.ref_year != 2016 || stats.cmd_failures) errors++;
+	return errors;
+}
+
+static const char *gps_mode_names[] = { "NMEA, 9600", "binary, 9600", "binary, 38400" };
+
+// The receiver never answers commands.
+static uint8_t gps_mute(uint32_t sec) {
+	return SIM_PPS | SIM_RMC | SIM_FIX;
+}
+
+// A multi-constellation receiver: GNRMC rather than GPRMC
+static uint8_t gps_gn(uint32_t sec) {
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK | SIM_GN;
+}
+
+// The receiver restarts five minutes in.
+static uint8_t gps_restart(uint32_t sec) {
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK | ((sec == 300)?SIM_RESTART:0);
+}
+
+// What the receiver sends, and what it costs to listen to it, with its
+// output cut down to RMC or switched to binary navigation data. Either way
+// the songs ought to come out right. If it won't do as it's told, the
+// firmware ought to carry on with everything it sends. If it restarts, the
+// firmware ought to notice and tell it again.
+static int bench_gps_mode(uint8_t mode, uint8_t (*gps)(uint32_t sec)) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	eeprom_write_byte(EE_GPS_MODE, mode);
+	sim_run(SCORE_START, 600, 0, gps);
+	make_score(600);
+	int64_t worst = check_score();
+
+	printf("  %-13s %-7s: %5.0f bytes/s, %4.0f rx interrupts/s, %.2f%% active, %s",
+		gps_mode_names[mode], (gps == gps_mute)?"no ACK":((gps == gps_gn)?"GNRMC ":((gps == gps_restart)?"restart":"      ")), sim.rx_bytes / 600.0,
+		sim.rx_isrs / 600.0, 100 * sim_duty(), gps_binary?"binary":(gps_rmc_only?"RMC only":"all NMEA"));
+	if (sim.rx_garbled) printf(", %llu garbled", (unsigned long long)sim.rx_garbled);
+	if (worst < 0) {
+		printf(", not the %zu strikes in the score\n", score_len);
+		return 1;
+	}
+	printf(", worst strike %lld us\n", (long long)worst);
+	if (gps == gps_mute) return worst > 2000 || gps_binary || gps_rmc_only;
+	return worst > 2000 || !(gps_binary || gps_rmc_only);
+}
+
+// Ask for a trace dump ten seconds after the hour.
+static uint8_t gps_dump(uint32_t sec) {
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK | ((sec == 190)?SIM_DUMP:0);
+}
+
+// The trace ought to come back whole when it's asked for, and show the
+// hour being struck: each note on for as long as its pulse.
+static int bench_trace(const char *save) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	sim_run(SCORE_START, 200, 0, gps_dump);
+	if (save != NULL) {
+		FILE *f = fopen(save, "wb");
+		if (f == NULL || fwrite(sim.txlog, 1, sim.txlog_len, f) != sim.txlog_len || fclose(f)) perror(save);
+	}
+
+	struct trace_rec recs[TRACE_LEN];
+	struct stats dumped;
+	int n = trace_decode(sim.txlog, sim.txlog_len, recs, &dumped);
+	printf("event trace, dumped 10 s after the hour:\n");
+	if (n < 0) {
+		printf("  no complete dump\n");
+		return 1;
+	}
+	int counts[16] = { 0 }, errors = 0;
+	double on[CHANNELS];
+	double span = recs[n - 1].ms - recs[0].ms;
+	for(int i = 0; i < n; i++) {
+		counts[recs[i].type & 15]++;
+		if (i > 0 && recs[i].ms < recs[i - 1].ms) errors++;
+		for(int c = 0; c < CHANNELS; c++) {
+			if (!(recs[i].arg & _BV(c))) continue;
+			if (recs[i].type == TRACE_NOTE_ON) on[c] = recs[i].ms;
+			// Within a tick
+			if (recs[i].type == TRACE_NOTE_OFF && fabs(recs[i].ms - on[c] - chime_cal[c].pulse) > 1.0) errors++;
+		}
+	}
+	printf("  %d events over %.3f s: %d PPS, %d seconds, %d rx, %d notes on, %d off, %d bytes sent\n", n, span / 1000,
+		counts[TRACE_PPS], counts[TRACE_SECOND], counts[TRACE_RX], counts[TRACE_NOTE_ON], counts[TRACE_NOTE_OFF],
+		(int)sim.txlog_len);
+	if (n != TRACE_LEN || counts[TRACE_NOTE_ON] == 0 || counts[TRACE_PPS] == 0) errors++;
+	// The stats went out 10 s before the end of the run.
+	printf("  stats: %u s counted from the PPS (%u by the end), %u checks, %+d ppm, %u commands given up on, %u bad checksums\n",
+		dumped.pps_counted, stats.pps_counted, dumped.pps_checks, dumped.osc_ppm, dumped.cmd_failures, dumped.rx_checksum_errors);
+	if (dumped.pps_counted == 0 || dumped.pps_counted > stats.pps_counted || stats.pps_counted - dumped.pps_counted > 11) errors++;
+	if (dumped.pps_checks > stats.pps_checks || dumped.osc_ppm != stats.osc_ppm || dumped.cmd_failures != stats.cmd_failures) errors++;
+
+	// What a clock built without the trace sends instead: no events, and only
+	// the stats it keeps.
+	uint8_t short_dump[4 + 3 + STATS_KEPT + 1] = { 0xa0, 0xa1, 0, 3 + STATS_KEPT, TRACE_MSG_ID, 0, 0 };
+	memcpy(short_dump + 7, &stats, STATS_KEPT);
+	for(size_t j = 4; j < sizeof(short_dump) - 1; j++) short_dump[sizeof(short_dump) - 1] ^= short_dump[j];
+	memset(&dumped, 0xff, sizeof(dumped));
+	n = trace_decode(short_dump, sizeof(short_dump), recs, &dumped);
+	printf("  without the trace: %s, %u bad checksums\n", (n == 0)?"stats only":"not decoded", dumped.rx_checksum_errors);
+	if (n != 0 || memcmp(&dumped, &stats, STATS_KEPT) || ((uint8_t *)&dumped)[STATS_KEPT] != 0) errors++;
+	if (errors) printf("  %d problems\n", errors);
+	return errors;
+}
+
+// How much of an hour the CPU spends awake.
+static void bench_idle(void) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	sim_run(SCORE_START, 3600, 0, gps_good);
+	printf("CPU duty cycle over an hour with a fix:\n");
+	printf("  %.0f wakeups/s (%.0f timer, %.0f rx, %.0f pps), %.0f loop passes/s, %.1f%% of passes ended asleep\n",
+		(sim.timer_isrs + sim.rx_isrs + sim.pps_isrs) / 3600.0, sim.timer_isrs / 3600.0, sim.rx_isrs / 3600.0,
+		sim.pps_isrs / 3600.0, sim.loops / 3600.0, sim.loops?100.0 * sim.sleeps / sim.loops:0);
+	printf("  active %.2f%% estimated (100%% spinning without sleep)\n", 100 * sim_duty());
+}
+
+int main(int argc, char **argv) {
+	uint32_t seconds = 86400;
+	const char *trace_file = NULL;
+	int argi = 1;
+	if (argi + 1 < argc && !strcmp(argv[argi], "-s")) {
+		seconds = strtoul(argv[argi + 1], NULL, 10);
+		argi += 2;
+	}
+	if (argi + 1 < argc && !strcmp(argv[argi], "-t")) {
+		trace_file = argv[argi + 1];
+		argi += 2;
+	}
+	if (argi < argc) {
+		for(; argi < argc; argi++) load_capture(argv[argi]);
+	} else {
+		synth_capture(seconds);
+	}
+
+	score_sched_default();
+	bench_parse();
+	int errors = bench_cut();
+	errors += bench_tz();
+	bench_chime();
+	printf("songs, an hour with a fix:\n");
+	errors += bench_songs(NULL);
+	// Lead time and pulse width for the four quarter bells and the hour gong
+	static const struct chime_cal cal[CHANNELS] = { { 12, 18 }, { 18, 20 }, { 25, 22 }, { 40, 30 }, { 90, 60 } };
+	errors += bench_songs(cal);
+	errors += bench_synth();
+	printf("PPS oscillator discipline, %u s after settling %u s:\n", 540, 60);
+	bench_pps(0);
+	bench_pps(-8000);
+	bench_pps(3000);
+	bench_pps(15000);
+	printf("holdover through a 6 minute loss of fix over the hour (16 notes + 10 strikes), +5000 ppm:\n");
+	bench_holdover(0);
+	bench_holdover(4);
+	errors += bench_day();
+	errors += bench_plan();
+	errors += bench_counting();
+	errors += bench_step();
+	errors += bench_lost();
+	printf("time labels vs. the PPS, 10 minutes (16 notes + 10 strikes):\n");
+	errors += bench_labels("10 Hz NMEA", GPS_NMEA, gps_tenths, 0);
+	errors += bench_labels("10 Hz binary", GPS_BINARY_FAST, gps_tenths, 0);
+	errors += bench_labels("edge to come", GPS_NMEA, gps_ahead, 1);
+	errors += bench_labels("held up", GPS_NMEA, gps_held_up, 0);
+	errors += bench_cmds();
+	printf("receiver output, 10 minutes (16 notes + 10 strikes):\n");
+	errors += bench_gps_mode(GPS_NMEA, gps_mute);
+	errors += bench_gps_mode(GPS_NMEA, gps_good);
+	errors += bench_gps_mode(GPS_NMEA, gps_gn);
+	errors += bench_gps_mode(GPS_NMEA, gps_restart);
+	errors += bench_gps_mode(GPS_BINARY, gps_good);
+	errors += bench_gps_mode(GPS_BINARY_FAST, gps_good);
+	errors += bench_gps_mode(GPS_BINARY_FAST, gps_mute);
+	errors += bench_gps_mode(GPS_BINARY_FAST, gps_restart);
+	errors += bench_trace(trace_file);
+	bench_idle();
+	return errors?1:0;
+}
@@ -0,0 +1,173 @@
+/*
+
+    GPS Clock - host hardware abstraction
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// This stands in for the avr-libc headers when GPS_Chime_Clock.c is built
+// natively (HOST_BUILD). The peripheral registers the firmware touches
+// (USART0, TIMER0-2, PCINT0, PORTA/PORTB, PRR) are plain variables, the
+// interrupt vectors become ordinary functions that a harness calls to
+// inject events, PROGMEM is ordinary memory and the EEPROM is an array.
+//
+// This header is meant to be pulled into exactly one translation unit:
+// the harness #includes GPS_Chime_Clock.c directly so that it can reach
+// the static functions.
+
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Peripheral registers
+#define HAL_REG(name) static volatile uint8_t name __attribute__((unused))
+#define HAL_REG16(name) static volatile uint16_t name __attribute__((unused))
+
+HAL_REG(UDR0);
+HAL_REG(UCSR0A);
+HAL_REG(UCSR0B);
+HAL_REG(UCSR0C);
+HAL_REG(UBRR0H);
+HAL_REG(UBRR0L);
+HAL_REG(PORTA);
+HAL_REG(PORTB);
+HAL_REG(PINA);
+HAL_REG(PUEA);
+HAL_REG(PUEB);
+HAL_REG(DDRA);
+HAL_REG(DDRB);
+HAL_REG(PRR);
+HAL_REG(TCCR2B);
+HAL_REG(TIMSK2);
+HAL_REG16(OCR2A);
+HAL_REG16(OCR2B);
+HAL_REG16(TCNT2);
+HAL_REG(TIFR2);
+HAL_REG(TCCR0A);
+HAL_REG(TCCR0B);
+HAL_REG(TIMSK0);
+HAL_REG(TIFR0);
+HAL_REG(OCR0A);
+HAL_REG(TCNT0);
+HAL_REG(TCCR1A);
+HAL_REG(TCCR1B);
+HAL_REG16(OCR1A);
+HAL_REG(TOCPMSA1);
+HAL_REG(TOCPMCOE);
+HAL_REG(PCMSK0);
+HAL_REG(GIMSK);
+
+// Register bit numbers (attiny841)
+#define U2X0 1
+#define UCSZ00 1
+#define UCSZ01 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define RXCIE0 7
+#define PRUSART0 1
+#define PRTIM2 6
+#define CS22 2
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+#define TOV2 0
+#define PCINT7 7
+#define PRTIM0 1
+#define PRTIM1 2
+#define WGM01 1
+#define CS01 1
+#define OCIE0A 1
+#define OCF0A 1
+#define WGM10 0
+#define WGM12 3
+#define CS10 0
+#define COM1A1 7
+#define TOCC4S0 0
+#define TOCC4OE 4
+#define PCIE0 4
+
+#define _BV(bit) (1 << (bit))
+
+// <util/setbaud.h> - what it works out for 9600 baud at 8 MHz, so that the
+// simulator can tell which baud rate the firmware is using.
+#define UBRRH_VALUE 0
+#define UBRRL_VALUE 51
+#define USE_2X 0
+
+// Interrupts. The harness calls the vector functions itself.
+#define ISR(vector) void vector(void)
+#define EMPTY_INTERRUPT(vector) void vector(void) { }
+#define sei()
+#define cli()
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for(uint8_t hal_atomic_once = 1; hal_atomic_once; hal_atomic_once = 0)
+
+// Flash
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+#define memcpy_P memcpy
+#define strchr_P strchr
+#define strncmp_P strncmp
+
+// EEPROM
+#define HAL_EEPROM_SIZE 512
+static uint8_t hal_eeprom[HAL_EEPROM_SIZE] __attribute__((unused));
+
+static inline uint8_t eeprom_read_byte(const uint8_t *addr) {
+	return hal_eeprom[(uintptr_t)addr % HAL_EEPROM_SIZE];
+}
+
+static inline void eeprom_read_block(void *dst, const void *addr, size_t len) {
+	for(size_t i = 0; i < len; i++)
+		((uint8_t *)dst)[i] = hal_eeprom[((uintptr_t)addr + i) % HAL_EEPROM_SIZE];
+}
+
+static inline void eeprom_write_byte(uint8_t *addr, uint8_t val) {
+	hal_eeprom[(uintptr_t)addr % HAL_EEPROM_SIZE] = val;
+}
+
+// The harness supplies this. It's called wherever the firmware would
+// otherwise spin waiting on hardware (wdt_reset() is called from every
+// such loop), so that the harness can service the TX interrupt or advance
+// the timer.
+void hal_host_poll(void);
+
+// Sleep. The harness can count how often the firmware would have slept.
+#define SLEEP_MODE_IDLE 0
+static uint32_t hal_sleeps __attribute__((unused));
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() (hal_sleeps++)
+
+// Watchdog
+#define WDTO_250MS 4
+#define wdt_enable(timeout)
+#define wdt_reset() hal_host_poll()
+
+#define __ATTR_NORETURN__ __attribute__((noreturn))
+
+// The harness has its own main().
+#define main chime_main
+
+#endif
@@ -0,0 +1,589 @@
+/*
+
+    GPS Clock - host simulation of the board and GPS receiver
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// Runs the firmware's real main() against simulated time. Include this
+// after GPS_Chime_Clock.c; it supplies hal_host_poll().
+//
+// Every time around the main loop (wdt_reset()), time moves on to the next
+// thing that would happen: TIMER2 overflowing or reaching one of its
+// compare values (TIMER2_OVF_vect, TIMER2_COMPA_vect, TIMER2_COMPB_vect,
+// if enabled), the next byte from the receiver (USART0_RX_vect) or the next
+// true second (PCINT0_vect, if the receiver sends a PPS edge that second).
+// If the firmware went around without sleeping, it's spinning, and time
+// moves on by no more than a timer count.
+// The receiver starts out sending the usual NMEA sentences at 9600 baud.
+// What the firmware transmits goes out instantly, and the receiver answers
+// binary commands with an ACK and, for queries, the answer - if it's
+// answering that second. It can be told which NMEA sentences to send, or
+// switched to binary navigation data and to a faster baud rate. If the firmware's UART isn't set to the same baud
+// rate, each side gets garbage.
+// The firmware's own processing takes no time. The timer runs off an
+// oscillator that can be off by any number of ppm. Rising edges on the
+// chime pins are logged with the true time, and how long each channel's
+// pulses last is kept. With the bells synthesized instead, TIMER0_COMPA_vect
+// is called every sample while it's enabled (from when the firmware last
+// zeroed TCNT0), and each note is logged when its first sample is made.
+//
+// The firmware's processing taking no time means the duty cycle has to be
+// estimated: sim_duty() charges a rough cycle cost for every interrupt and
+// every pass around the main loop, and counts the CPU as busy the whole
+// time if the firmware never went to sleep.
+//
+// With sim_wall_start set, the run goes in real time instead, with the
+// true time counted on the host's monotonic clock from then, so that
+// several of them in their own processes can share a timing bus (see
+// host/synctest). What the firmware sends is also written to sim_bus_out
+// as it's sent, and what comes in on sim_bus_in arrives at the UART a byte
+// time later, one byte after another. If a byte from the bus arrives while
+// one from the receiver is coming in, the bus byte is garbled.
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+// What the receiver does in a given second
+#define SIM_PPS 1 // sends the PPS edge
+#define SIM_RMC 2 // sends its navigation output (NMEA or binary)
+#define SIM_FIX 4 // which says A rather than V
+#define SIM_ACK 8 // answers commands
+#define SIM_GN 16 // is a multi-constellation receiver, with the GN talker ID
+#define SIM_RESTART 32 // restarts, forgetting everything it was told
+#define SIM_DUMP 64 // something on the line asks for a trace dump, before the output
+#define SIM_STEP 128 // its output says it's a second later than it is
+
+#define SIM_NS (1000000000ULL)
+// How long after the PPS the receiver starts sending its output
+#define SIM_RMC_DELAY (100000000ULL)
+// How long the receiver takes to answer a command
+#define SIM_ACK_DELAY (20000000ULL)
+// GPS - UTC in 2016
+#define SIM_LEAP 17
+// 1980-01-06, the start of GPS time
+#define SIM_GPS_EPOCH (315964800)
+
+// Rough cycle costs at 8 MHz, including interrupt entry, register saves
+// and reti, or waking from idle and going around the loop once. The loop
+// includes bringing ticks up to date and working out when to wake, with
+// a software multiply (there's no MUL on the ATtiny).
+#define SIM_F_CPU (8000000.0)
+#define SIM_CYCLES_TIMER 80
+#define SIM_CYCLES_RX 90
+#define SIM_CYCLES_PPS 70
+#define SIM_CYCLES_LOOP 250
+// The sample interrupt is measured, averaged over a day of make sim with
+// FEATURES=-DWITH_SYNTH and -a: 292 cycles, and 397 at the worst.
+#define SIM_CYCLES_SAMPLE 292
+
+struct sim_strike {
+	uint64_t t; // true time, ns
+	uint8_t chord;
+};
+
+static struct {
+	int active;
+	uint8_t (*gps)(uint32_t sec); // what the receiver does each second
+	time_t epoch; // UTC at the start of the run
+	double count_ns; // how long a timer count really lasts
+	uint64_t now, end;
+	uint32_t last_sleeps; // hal_sleeps at the last time around
+	uint32_t sec; // the next true second
+	uint8_t out[1024]; // what the receiver is sending
+	size_t out_len, out_pos;
+	uint64_t out_start;
+	uint32_t out_byte_ns; // at the baud rate it had when it started
+	uint32_t baud; // the receiver's
+	uint8_t binary; // sending binary navigation data instead of NMEA
+	uint8_t nmea[7]; // whether it sends GGA, GSA, GSV, GLL, RMC, VTG, ZDA
+	// How long after the PPS its output starts, and how many times a second
+	// it sends it (1 or 10). The gps function can change these as it goes.
+	uint64_t out_delay;
+	uint8_t out_hz;
+	uint8_t tenth; // the next tenth of a second it sends at, 0 for the next second
+	uint8_t tenth_what;
+	uint32_t tenth_told;
+	uint64_t rx_bytes, rx_garbled;
+	uint64_t rx_last; // when the last byte from the receiver came in
+	uint8_t bus[256]; // what's coming in on the bus, and when, in a ring
+	uint64_t bus_t[256];
+	uint8_t bus_head, bus_tail;
+	uint64_t bus_bytes, bus_garbled;
+	uint8_t tx[32]; // the command the firmware is sending
+	size_t tx_len;
+	uint8_t txlog[4096]; // everything the firmware sent
+	size_t txlog_len;
+	struct sim_cmd {
+		uint64_t t;
+		uint8_t id; // message ID, or the sub-ID for 0x64
+	} cmds[64]; // the commands it sent
+	size_t n_cmds;
+	// What the receiver has stored
+	uint16_t ref_year;
+	uint8_t ref_mon, ref_day;
+	uint8_t leap_default;
+	uint8_t pins; // the chord on the output pins at the last look
+	struct sim_strike strikes[4096];
+	size_t n_strikes;
+	uint64_t rise[8]; // when each channel last went on
+	uint64_t pulse_min[8], pulse_max[8]; // ns
+	uint64_t sample_next; // the next TIMER0 compare
+	uint64_t samples_clipped;
+	uint64_t loops; // times around the main loop
+	uint32_t second_tick; // the firmware's, at the last look
+	uint32_t seconds_started; // times the main loop moved it on
+	uint64_t timer_isrs, rx_isrs, pps_isrs, sample_isrs;
+	uint32_t sleeps;
+	jmp_buf done;
+} sim;
+
+static uint64_t sim_tx_bytes;
+
+// Real time (CLOCK_MONOTONIC, ns) at the start of the run, or 0 to run as
+// fast as possible, and the timing bus. These aren't reset by sim_run().
+static uint64_t sim_wall_start;
+static int sim_bus_in = -1, sim_bus_out = -1;
+
+// The receiver's output out of the box
+static void sim_receiver_defaults(void) {
+	static const uint8_t nmea_default[7] = { 1, 1, 1, 0, 1, 1, 0 };
+	memcpy(sim.nmea, nmea_default, sizeof(sim.nmea));
+	sim.binary = 0;
+	sim.baud = 9600;
+}
+
+// How long a byte takes (10 bits) at a baud rate
+static inline uint32_t sim_byte_ns(uint32_t baud) {
+	return 10 * SIM_NS / baud;
+}
+
+// ... and at the firmware's, from the UBRR setting
+static inline uint32_t sim_uart_byte_ns(void) {
+	uint32_t ubrr = ((UBRR0H << 8) | UBRR0L) + 1;
+	return 10 * SIM_NS * ubrr * ((UCSR0A & _BV(U2X0))?8:16) / (uint64_t)SIM_F_CPU;
+}
+
+// Whether the two ends agree to within what a UART can stand
+static inline int sim_baud_match(uint32_t byte_ns) {
+	uint32_t uart = sim_uart_byte_ns();
+	uint32_t diff = (uart > byte_ns)?uart - byte_ns:byte_ns - uart;
+	return diff * 25 < byte_ns; // 4%
+}
+
+// Have the receiver send something, starting no sooner than when.
+static void sim_send(const uint8_t *data, size_t len, uint64_t when) {
+	if (sim.out_pos == sim.out_len) {
+		sim.out_pos = sim.out_len = 0;
+		sim.out_start = when;
+		sim.out_byte_ns = sim_byte_ns(sim.baud);
+	}
+	if (sim.out_len + len > sizeof(sim.out)) return;
+	memcpy(sim.out + sim.out_len, data, len);
+	sim.out_len += len;
+}
+
+static void sim_send_binary(const uint8_t *payload, uint8_t len, uint64_t when) {
+	uint8_t msg[80] = { 0xa0, 0xa1, 0, len };
+	uint8_t checksum = 0;
+	for(int i = 0; i < len; i++) checksum ^= (msg[4 + i] = payload[i]);
+	msg[4 + len] = checksum;
+	msg[5 + len] = 0x0d;
+	msg[6 + len] = 0x0a;
+	sim_send(msg, len + 7, when);
+}
+
+// A byte from the firmware to the receiver
+static void sim_tx(uint8_t c) {
+	sim_tx_bytes++;
+	if (sim.active && sim_bus_out >= 0 && write(sim_bus_out, &c, 1) != 1) sim_bus_out = -1;
+	if (sim.active && sim.txlog_len < sizeof(sim.txlog)) sim.txlog[sim.txlog_len++] = c;
+	if (sim.active && !sim_baud_match(sim_byte_ns(sim.baud))) return; // it hears noise
+	if (sim.tx_len == 0 && c != 0xa0) return;
+	sim.tx[sim.tx_len++] = c;
+	if (sim.tx_len < 4) return;
+	uint8_t len = sim.tx[3];
+	if (sim.tx_len < len + 7u && sim.tx_len < sizeof(sim.tx)) return;
+	sim.tx_len = 0;
+	const uint8_t *payload = sim.tx + 4;
+	uint8_t checksum = 0;
+	for(int i = 0; i < len; i++) checksum ^= payload[i];
+	if (len < 2 || payload[len] != checksum) return;
+	if (payload[0] == TRACE_MSG_ID || payload[0] == SYNC_MSG_ID) return; // a trace dump or timing frame, not for the receiver
+	uint8_t id = (payload[0] == 0x64)?payload[1]:payload[0];
+
+	if (sim.n_cmds < sizeof(sim.cmds) / sizeof(sim.cmds[0])) {
+		sim.cmds[sim.n_cmds].t = sim.now;
+		sim.cmds[sim.n_cmds++].id = id;
+	}
+	if (!sim.active || !(sim.gps(sim.sec - 1) & SIM_ACK)) return;
+	uint8_t ack[] = { 0x83, payload[0], payload[1] };
+	sim_send_binary(ack, (payload[0] == 0x64)?3:2, sim.now + SIM_ACK_DELAY);
+	switch(payload[0]) {
+		case 0x05:
+			{
+				// It switches once the ACK is out.
+				static const uint32_t bauds[] = { 4800, 9600, 19200, 38400, 57600, 115200 };
+				if (len >= 3 && payload[2] < sizeof(bauds) / sizeof(bauds[0])) sim.baud = bauds[payload[2]];
+			}
+			return;
+		case 0x08:
+			if (len >= 8) {
+				for(int i = 0; i < 7; i++) sim.nmea[i] = payload[1 + i] != 0;
+			}
+			return;
+		case 0x09:
+			if (len >= 2) sim.binary = payload[1] == 2;
+			return;
+		case 0x64:
+			break;
+		default:
+			return;
+	}
+	switch(payload[1]) {
+		case 0x15:
+			sim.ref_year = (payload[3] << 8) | payload[4];
+			sim.ref_mon = payload[5];
+			sim.ref_day = payload[6];
+			break;
+		case 0x16:
+			{
+				uint8_t answer[] = { 0x64, 0x8a, 1, sim.ref_year >> 8, sim.ref_year, sim.ref_mon, sim.ref_day };
+				sim_send_binary(answer, sizeof(answer), sim.now + SIM_ACK_DELAY);
+			}
+			break;
+		case 0x1f:
+			sim.leap_default = payload[2];
+			break;
+		case 0x20:
+			{
+				// Only the leap seconds matter here: the default, the current
+				// count, and the valid bit.
+				uint8_t answer[16] = { 0x64, 0x8e };
+				answer[12] = sim.leap_default;
+				answer[13] = SIM_LEAP;
+				answer[14] = 1 << 2;
+				sim_send_binary(answer, 15, sim.now + SIM_ACK_DELAY);
+			}
+			break;
+	}
+}
+
+static void sim_nmea(const char *body) {
+	uint8_t checksum = 0;
+	for(const char *p = body; *p; p++) checksum ^= *p;
+	char line[96];
+	size_t len = snprintf(line, sizeof(line), "$%s*%02X\r\n", body, checksum);
+	sim_send((const uint8_t *)line, len, sim.now + sim.out_delay);
+}
+
+// The receiver's NMEA output. Out of the box that's a burst of sentences,
+// of which only the RMC matters. A 10 Hz receiver labels them with tenths.
+static void sim_rmc(uint32_t sec, uint8_t tenth, uint8_t what) {
+	time_t t = sim.epoch + sec;
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	uint8_t fix = what & SIM_FIX;
+	char talker = (what & SIM_GN)?'N':'P';
+	char body[96];
+	if (sim.nmea[0]) {
+		snprintf(body, sizeof(body), "G%cGGA,%02d%02d%02d.%d00,3723.2475,N,12158.3416,W,%d,08,0.9,545.4,M,46.9,M,,",
+			talker, tm.tm_hour, tm.tm_min, tm.tm_sec, tenth, fix?1:0);
+		sim_nmea(body);
+	}
+	if (sim.nmea[1]) {
+		snprintf(body, sizeof(body), "G%cGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1", talker);
+		sim_nmea(body);
+	}
+	if (sim.nmea[2]) {
+		// Satellites in view are per constellation, so always GP.
+		sim_nmea("GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00");
+		sim_nmea("GPGSV,3,2,11,14,25,170,00,16,57,208,39,18,67,296,40,19,40,246,00");
+		sim_nmea("GPGSV,3,3,11,22,42,067,42,24,14,311,43,27,05,244,00,,,,");
+	}
+	if (sim.nmea[4]) {
+		snprintf(body, sizeof(body), "G%cRMC,%02d%02d%02d.%d00,%c,3723.2475,N,12158.3416,W,0.01,180.80,%02d%02d%02d,,,D",
+			talker, tm.tm_hour, tm.tm_min, tm.tm_sec, tenth, fix?'A':'V', tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+		sim_nmea(body);
+	}
+	if (sim.nmea[5]) {
+		snprintf(body, sizeof(body), "G%cVTG,180.80,T,,M,0.01,N,0.02,K,D", talker);
+		sim_nmea(body);
+	}
+}
+
+// Binary navigation data (0xA8): fix mode, GPS week and time of week in
+// 10 ms units, big endian. The position and velocity are left as zeros.
+static void sim_nav(uint32_t sec, uint8_t tenth, uint8_t fix) {
+	uint64_t gps = sim.epoch + sec - SIM_GPS_EPOCH + SIM_LEAP;
+	uint16_t week = gps / 604800;
+	uint32_t tow = (gps % 604800) * 100 + tenth * 10;
+	uint8_t nav[59] = { 0xa8, fix?2:0, 8, week >> 8, week, tow >> 24, tow >> 16, tow >> 8, tow };
+	sim_send_binary(nav, sizeof(nav), sim.now + sim.out_delay);
+}
+
+static inline uint8_t sim_chord(void) {
+	return (PORTA & _BV(0)) | ((PORTA & _BV(3)) >> 2) | ((PORTB & 0x07) << 2);
+}
+
+// The timer count at a given time, and when it gets to a count
+static inline uint64_t sim_count_time(uint64_t count) {
+	return (uint64_t)ceil(count * sim.count_ns);
+}
+
+static inline uint64_t sim_count(uint64_t t) {
+	uint64_t count = t / sim.count_ns;
+	if (sim_count_time(count + 1) <= t) count++; // rounding
+	return count;
+}
+
+// The next count after this one that the bottom 16 bits match compare at
+static inline uint64_t sim_match(uint64_t count, uint16_t compare) {
+	return count + (uint16_t)(compare - count - 1) + 1;
+}
+
+// How long a synthesizer sample really lasts
+static inline uint64_t sim_sample_ns(void) {
+	return llround(sim.count_ns * (SYNTH_TOP + 1) * 8 / 256);
+}
+
+// The true time in a real time run, which is negative before it starts
+static int64_t sim_wall(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)((uint64_t)ts.tv_sec * SIM_NS + ts.tv_nsec - sim_wall_start);
+}
+
+// In a real time run, wait for the true time to get to until. Returns 1 if
+// something came in on the bus first, having queued it up.
+static int sim_bus_wait(uint64_t until) {
+	if (!sim_wall_start) return 0;
+	if (until > sim.end) until = sim.end;
+	while (1) {
+		int64_t now = sim_wall();
+		if (now >= (int64_t)until) return 0;
+		fd_set in;
+		FD_ZERO(&in);
+		if (sim_bus_in >= 0) FD_SET(sim_bus_in, &in);
+		struct timespec ts = { (until - now) / SIM_NS, (until - now) % SIM_NS };
+		if (pselect(sim_bus_in + 1, &in, NULL, NULL, &ts, NULL) <= 0 || sim_bus_in < 0) continue;
+		uint8_t buf[64];
+		ssize_t len = read(sim_bus_in, buf, sizeof(buf));
+		if (len <= 0) {
+			sim_bus_in = -1; // the bus is gone
+			continue;
+		}
+		uint64_t at = (sim_wall() > (int64_t)sim.now)?(uint64_t)sim_wall():sim.now;
+		uint8_t last = sim.bus_tail - 1;
+		if (sim.bus_head != sim.bus_tail && sim.bus_t[last] > at) at = sim.bus_t[last];
+		for(ssize_t i = 0; i < len && (uint8_t)(sim.bus_tail + 1) != sim.bus_head; i++) {
+			at += sim_uart_byte_ns();
+			sim.bus[sim.bus_tail] = buf[i];
+			sim.bus_t[sim.bus_tail++] = at;
+		}
+		return 1;
+	}
+}
+
+void hal_host_poll(void) {
+	// Play the part of the UART data register empty interrupt.
+	while (UCSR0B & _BV(UDRIE0)) {
+		USART0_UDRE_vect();
+		sim_tx(UDR0);
+	}
+	if (!sim.active) return;
+
+	sim.loops++;
+	if (second_tick != sim.second_tick) {
+		sim.second_tick = second_tick;
+		sim.seconds_started++;
+	}
+	uint8_t chord = sim_chord();
+	uint8_t rising = chord & ~sim.pins;
+	uint8_t falling = sim.pins & ~chord;
+	sim.pins = chord;
+	for(int i = 0; i < 8; i++) {
+		if (rising & _BV(i)) sim.rise[i] = sim.now;
+		if (falling & _BV(i)) {
+			uint64_t pulse = sim.now - sim.rise[i];
+			if (pulse < sim.pulse_min[i]) sim.pulse_min[i] = pulse;
+			if (pulse > sim.pulse_max[i]) sim.pulse_max[i] = pulse;
+		}
+	}
+	if (rising && sim.n_strikes < sizeof(sim.strikes) / sizeof(sim.strikes[0])) {
+		sim.strikes[sim.n_strikes].t = sim.now;
+		sim.strikes[sim.n_strikes++].chord = rising;
+	}
+
+	// TIMER0 counts SYNTH_TOP + 1 microseconds (of the oscillator's) to a
+	// sample. Nothing else writes TCNT0, so a zero there is the firmware
+	// starting it over.
+	if (TCNT0 == 0) {
+		TCNT0 = 1;
+		sim.sample_next = sim.now + sim_sample_ns();
+	}
+
+	// The timer started counting with the run. Ties go to the timer, so that
+	// the overflow is counted before anything looks at the count.
+	uint64_t count = sim_count(sim.now);
+	uint64_t spin = UINT64_MAX;
+	if (hal_sleeps == sim.last_sleeps) spin = sim_count_time(count + 1);
+	sim.last_sleeps = hal_sleeps;
+	uint64_t next_ovf, next_a, next_b, next_sample, next_byte, next_bus, next_sec, t;
+	do {
+		next_ovf = sim_count_time((count | 0xffff) + 1);
+		next_a = (TIMSK2 & _BV(OCIE2A))?sim_count_time(sim_match(count, OCR2A)):UINT64_MAX;
+		next_b = (TIMSK2 & _BV(OCIE2B))?sim_count_time(sim_match(count, OCR2B)):UINT64_MAX;
+		next_sample = (TIMSK0 & _BV(OCIE0A))?sim.sample_next:UINT64_MAX;
+		next_byte = (sim.out_pos < sim.out_len)?sim.out_start + sim.out_pos * sim.out_byte_ns:UINT64_MAX;
+		next_bus = (sim.bus_head != sim.bus_tail)?sim.bus_t[sim.bus_head]:UINT64_MAX;
+		next_sec = sim.tenth?(sim.sec - 1) * SIM_NS + sim.tenth * (SIM_NS / 10):sim.sec * SIM_NS;
+		t = next_ovf;
+		if (next_a < t) t = next_a;
+		if (next_b < t) t = next_b;
+		if (next_sample < t) t = next_sample;
+		if (next_byte < t) t = next_byte;
+		if (next_bus < t) t = next_bus;
+		if (next_sec < t) t = next_sec;
+	} while (sim_bus_wait((spin < t)?spin:t));
+	if (spin < t) {
+		if (spin >= sim.end) longjmp(sim.done, 1);
+		sim.now = spin;
+		TCNT2 = sim_count(spin);
+		return;
+	}
+	if (t >= sim.end) longjmp(sim.done, 1);
+	sim.now = t;
+	TCNT2 = sim_count(t);
+
+	if (t == next_ovf) {
+		TIMER2_OVF_vect();
+		sim.timer_isrs++;
+	} else if (t == next_a) {
+		TIMER2_COMPA_vect();
+		sim.timer_isrs++;
+	} else if (t == next_b) {
+		TIMER2_COMPB_vect();
+		sim.timer_isrs++;
+	} else if (t == next_sample) {
+		// A voice that was struck since the last sample is still at the start.
+		uint8_t started = 0;
+		for(uint8_t i = 0; i < CHANNELS; i++) {
+			if (synth_voices[i].phase == 0 && synth_voices[i].atten == 0) started |= _BV(i);
+		}
+		TIMER0_COMPA_vect();
+		sim.sample_isrs++;
+		sim.sample_next += sim_sample_ns();
+		if (OCR1A == 0 || OCR1A == 255) sim.samples_clipped++;
+		if (started && sim.n_strikes < sizeof(sim.strikes) / sizeof(sim.strikes[0])) {
+			sim.strikes[sim.n_strikes].t = t;
+			sim.strikes[sim.n_strikes++].chord = started;
+		}
+	} else if (t == next_byte) {
+		UDR0 = sim.out[sim.out_pos++];
+		if (!sim_baud_match(sim.out_byte_ns)) {
+			UDR0 = 0xff; // a framing error, or worse
+			sim.rx_garbled++;
+		}
+		USART0_RX_vect();
+		sim.rx_isrs++;
+		sim.rx_bytes++;
+		sim.rx_last = t;
+	} else if (t == next_bus) {
+		UDR0 = sim.bus[sim.bus_head++];
+		uint64_t byte_ns = sim_uart_byte_ns();
+		if (next_byte < t + byte_ns || (sim.rx_last && sim.rx_last + byte_ns > t)) {
+			UDR0 = 0xff;
+			sim.bus_garbled++;
+		}
+		USART0_RX_vect();
+		sim.rx_isrs++;
+		sim.bus_bytes++;
+	} else if (sim.tenth) {
+		// The rest of a 10 Hz receiver's output for the second
+		if (sim.binary) sim_nav(sim.tenth_told, sim.tenth, sim.tenth_what & SIM_FIX);
+		else sim_rmc(sim.tenth_told, sim.tenth, sim.tenth_what);
+		if (++sim.tenth == 10) sim.tenth = 0;
+	} else {
+		uint8_t what = sim.gps(sim.sec);
+		if (what & SIM_RESTART) sim_receiver_defaults();
+		if (what & SIM_DUMP) {
+			uint8_t b = TRACE_DUMP_BYTE;
+			sim_send(&b, 1, sim.now + SIM_RMC_DELAY / 2);
+		}
+		if (what & SIM_PPS) {
+			PINA |= _BV(7);
+			PCINT0_vect();
+			sim.pps_isrs++;
+			PINA &= ~_BV(7);
+		}
+		if (what & SIM_RMC) {
+			uint32_t told = sim.sec + ((what & SIM_STEP)?1:0);
+			if (sim.binary) sim_nav(told, 0, what & SIM_FIX);
+			else sim_rmc(told, 0, what);
+			if (sim.out_hz == 10) {
+				sim.tenth = 1;
+				sim.tenth_what = what;
+				sim.tenth_told = told;
+			}
+		}
+		sim.sec++;
+	}
+}
+
+// Run main() for the given number of seconds, starting at epoch (UTC),
+// with the timer oscillator off by ppm.
+static void sim_run(time_t epoch, uint32_t seconds, double ppm, uint8_t (*gps)(uint32_t sec)) {
+	memset(&sim, 0, sizeof(sim));
+	sim.gps = gps;
+	sim.epoch = epoch;
+	sim.count_ns = 32000.0 / (1 + ppm * 1e-6);
+	sim.end = seconds * SIM_NS;
+	sim.last_sleeps = hal_sleeps;
+	// The receiver's reference date is out of date, and so is its leap second default.
+	sim.ref_year = 2006;
+	sim.ref_mon = 1;
+	sim.ref_day = 1;
+	sim.leap_default = 16;
+	sim.out_delay = SIM_RMC_DELAY;
+	sim.out_hz = 1;
+	sim_receiver_defaults();
+	for(int i = 0; i < 8; i++) sim.pulse_min[i] = UINT64_MAX;
+	// TIMER0 and its interrupt are off out of reset.
+	TIMSK0 = 0;
+	TCNT0 = 0;
+	sim.active = 1;
+	uint32_t sleeps = hal_sleeps;
+	if (!setjmp(sim.done)) chime_main();
+	sim.sleeps = hal_sleeps - sleeps;
+	sim.active = 0;
+}
+
+// The fraction of the last run the CPU spent awake.
+static __attribute__((unused)) double sim_duty(void) {
+	if (sim.sleeps == 0) return 1.0; // it spun the whole time
+	double cycles = sim.timer_isrs * SIM_CYCLES_TIMER + sim.rx_isrs * SIM_CYCLES_RX
+		+ sim.pps_isrs * SIM_CYCLES_PPS + sim.sample_isrs * SIM_CYCLES_SAMPLE + sim.loops * SIM_CYCLES_LOOP;
+	return cycles / (SIM_F_CPU * sim.end / SIM_NS);
+}
+
+#endif
@@ -0,0 +1,232 @@
+/*
+
+    GPS Clock - ATtiny841 core for simavr
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// simavr doesn't come with an ATtiny841, so this declares one the same
+// way simavr's own cores are declared, with the register addresses and
+// vector numbers taken from avr-libc's iotn841.h. Only what the clock uses
+// is here: the two ports (with pin change interrupts), USART0, the timers
+// and the EEPROM. The timer output compare pin mux isn't, so nothing comes
+// out on a pin from TIMER1's PWM.
+//
+// The 841 protects WDTCSR with the CCP register, which simavr's watchdog
+// doesn't know about, so there's no watchdog. avrsim watches the time
+// between wdr instructions instead.
+
+#include "sim_avr.h"
+
+#define SIM_VECTOR_SIZE 2
+#define SIM_MMCU "attiny841"
+#define SIM_CORENAME mcu_tn841
+
+#define _AVR_IO_H_
+#define __ASSEMBLER__
+#include "avr/iotn841.h"
+
+#include "sim_core_declare.h"
+#include "avr_eeprom.h"
+#include "avr_ioport.h"
+#include "avr_uart.h"
+#include "avr_timer.h"
+
+#include "sim_tn841.h"
+
+struct mcu_t {
+	avr_t core;
+	avr_eeprom_t eeprom;
+	avr_ioport_t porta, portb;
+	avr_uart_t uart0;
+	avr_timer_t timer0, timer1, timer2;
+};
+
+static void tn841_init(struct avr_t *avr) {
+	struct mcu_t *mcu = (struct mcu_t *)avr;
+	avr_eeprom_init(avr, &mcu->eeprom);
+	avr_ioport_init(avr, &mcu->porta);
+	avr_ioport_init(avr, &mcu->portb);
+	avr_uart_init(avr, &mcu->uart0);
+	avr_timer_init(avr, &mcu->timer0);
+	avr_timer_init(avr, &mcu->timer1);
+	avr_timer_init(avr, &mcu->timer2);
+}
+
+static void tn841_reset(struct avr_t *avr) {
+}
+
+static const struct mcu_t SIM_CORENAME = {
+	.core = {
+		.mmcu = SIM_MMCU,
+		DEFAULT_CORE(SIM_VECTOR_SIZE),
+		.init = tn841_init,
+		.reset = tn841_reset,
+	},
+	AVR_EEPROM_DECLARE(EE_RDY_vect),
+	.porta = {
+		.name = 'A', .r_port = PORTA, .r_ddr = DDRA, .r_pin = PINA,
+		.pcint = {
+			.enable = AVR_IO_REGBIT(GIMSK, PCIE0),
+			.raised = AVR_IO_REGBIT(GIFR, PCIF0),
+			.vector = PCINT0_vect,
+		},
+		.r_pcint = PCMSK0,
+	},
+	.portb = {
+		.name = 'B', .r_port = PORTB, .r_ddr = DDRB, .r_pin = PINB,
+		.pcint = {
+			.enable = AVR_IO_REGBIT(GIMSK, PCIE1),
+			.raised = AVR_IO_REGBIT(GIFR, PCIF1),
+			.vector = PCINT1_vect,
+		},
+		.r_pcint = PCMSK1,
+	},
+	AVR_UART_DECLARE(PRR, PRUSART0, UPE, 0, 0),
+	.timer0 = {
+		.name = '0',
+		.disabled = AVR_IO_REGBIT(PRR, PRTIM0),
+		.wgm = { AVR_IO_REGBIT(TCCR0A, WGM00), AVR_IO_REGBIT(TCCR0A, WGM01), AVR_IO_REGBIT(TCCR0B, WGM02) },
+		.wgm_op = {
+			[0] = AVR_TIMER_WGM_NORMAL8(),
+			[2] = AVR_TIMER_WGM_CTC(),
+			[3] = AVR_TIMER_WGM_FASTPWM8(),
+		},
+		.cs = { AVR_IO_REGBIT(TCCR0B, CS00), AVR_IO_REGBIT(TCCR0B, CS01), AVR_IO_REGBIT(TCCR0B, CS02) },
+		.cs_div = { 0, 0, 3 /* 8 */, 6 /* 64 */, 8 /* 256 */, 10 /* 1024 */ },
+
+		.r_tcnt = TCNT0,
+
+		.overflow = {
+			.enable = AVR_IO_REGBIT(TIMSK0, TOIE0),
+			.raised = AVR_IO_REGBIT(TIFR0, TOV0),
+			.vector = TIMER0_OVF_vect,
+		},
+		.comp = {
+			[AVR_TIMER_COMPA] = {
+				.r_ocr = OCR0A,
+				.interrupt = {
+					.enable = AVR_IO_REGBIT(TIMSK0, OCIE0A),
+					.raised = AVR_IO_REGBIT(TIFR0, OCF0A),
+					.vector = TIMER0_COMPA_vect,
+				},
+			},
+		},
+	},
+	.timer1 = {
+		.name = '1',
+		.disabled = AVR_IO_REGBIT(PRR, PRTIM1),
+		.wgm = { AVR_IO_REGBIT(TCCR1A, WGM10), AVR_IO_REGBIT(TCCR1A, WGM11),
+			AVR_IO_REGBIT(TCCR1B, WGM12), AVR_IO_REGBIT(TCCR1B, WGM13) },
+		.wgm_op = {
+			[0] = AVR_TIMER_WGM_NORMAL16(),
+			[5] = AVR_TIMER_WGM_FASTPWM8(),
+		},
+		.cs = { AVR_IO_REGBIT(TCCR1B, CS10), AVR_IO_REGBIT(TCCR1B, CS11), AVR_IO_REGBIT(TCCR1B, CS12) },
+		.cs_div = { 0, 0, 3 /* 8 */, 6 /* 64 */, 8 /* 256 */, 10 /* 1024 */ },
+
+		.r_tcnt = TCNT1L,
+		.r_tcnth = TCNT1H,
+
+		.overflow = {
+			.enable = AVR_IO_REGBIT(TIMSK1, TOIE1),
+			.raised = AVR_IO_REGBIT(TIFR1, TOV1),
+			.vector = TIMER1_OVF_vect,
+		},
+		.comp = {
+			[AVR_TIMER_COMPA] = {
+				.r_ocr = OCR1AL,
+				.r_ocrh = OCR1AH,
+				.interrupt = {
+					.enable = AVR_IO_REGBIT(TIMSK1, OCIE1A),
+					.raised = AVR_IO_REGBIT(TIFR1, OCF1A),
+					.vector = TIMER1_COMPA_vect,
+				},
+			},
+		},
+	},
+	.timer2 = {
+		.name = '2',
+		.disabled = AVR_IO_REGBIT(PRR, PRTIM2),
+		.wgm = { AVR_IO_REGBIT(TCCR2A, WGM20), AVR_IO_REGBIT(TCCR2A, WGM21),
+			AVR_IO_REGBIT(TCCR2B, WGM22), AVR_IO_REGBIT(TCCR2B, WGM23) },
+		.wgm_op = {
+			[0] = AVR_TIMER_WGM_NORMAL16(),
+			[4] = AVR_TIMER_WGM_CTC(),
+			[12] = AVR_TIMER_WGM_ICCTC(),
+		},
+		.cs = { AVR_IO_REGBIT(TCCR2B, CS20), AVR_IO_REGBIT(TCCR2B, CS21), AVR_IO_REGBIT(TCCR2B, CS22) },
+		.cs_div = { 0, 0, 3 /* 8 */, 6 /* 64 */, 8 /* 256 */, 10 /* 1024 */ },
+
+		.r_tcnt = TCNT2L,
+		.r_tcnth = TCNT2H,
+		.r_icr = ICR2L,
+		.r_icrh = ICR2H,
+
+		.overflow = {
+			.enable = AVR_IO_REGBIT(TIMSK2, TOIE2),
+			.raised = AVR_IO_REGBIT(TIFR2, TOV2),
+			.vector = TIMER2_OVF_vect,
+		},
+		.icr = {
+			.enable = AVR_IO_REGBIT(TIMSK2, ICIE2),
+			.raised = AVR_IO_REGBIT(TIFR2, ICF2),
+			.vector = TIMER2_CAPT_vect,
+		},
+		.comp = {
+			[AVR_TIMER_COMPA] = {
+				.r_ocr = OCR2AL,
+				.r_ocrh = OCR2AH,
+				.interrupt = {
+					.enable = AVR_IO_REGBIT(TIMSK2, OCIE2A),
+					.raised = AVR_IO_REGBIT(TIFR2, OCF2A),
+					.vector = TIMER2_COMPA_vect,
+				},
+			},
+			[AVR_TIMER_COMPB] = {
+				.r_ocr = OCR2BL,
+				.r_ocrh = OCR2BH,
+				.interrupt = {
+					.enable = AVR_IO_REGBIT(TIMSK2, OCIE2B),
+					.raised = AVR_IO_REGBIT(TIFR2, OCF2B),
+					.vector = TIMER2_COMPB_vect,
+				},
+			},
+		},
+	},
+};
+
+avr_t *tn841_make(void) {
+	return avr_core_allocate(&SIM_CORENAME.core, sizeof(struct mcu_t));
+}
+
+// The vectors avrsim watches. Here, because only this file can see iotn841.h.
+const uint8_t tn841_vectors[TN841_VECTORS] = {
+	[TN841_PCINT0] = PCINT0_vect_num,
+	[TN841_TIMER2_COMPA] = TIMER2_COMPA_vect_num,
+	[TN841_TIMER2_COMPB] = TIMER2_COMPB_vect_num,
+	[TN841_TIMER2_OVF] = TIMER2_OVF_vect_num,
+	[TN841_USART0_RX] = USART0_RX_vect_num,
+	[TN841_USART0_UDRE] = USART0_UDRE_vect_num,
+	[TN841_TIMER0_COMPA] = TIMER0_COMPA_vect_num,
+};
+
+// Where TCNT0 is, in data space
+const uint16_t tn841_tcnt0 = TCNT0;
+
+// And SPL, with SPH after it. They're in avr/common.h, not iotn841.h.
+const uint16_t tn841_spl = 0x3d + 32;
@@ -0,0 +1,44 @@
+/*
+
+    GPS Clock - ATtiny841 core for simavr
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+#ifndef SIM_TN841_H
+#define SIM_TN841_H
+
+#include <stdint.h>
+
+// The interrupts avrsim times
+#define TN841_PCINT0 0
+#define TN841_TIMER2_COMPA 1
+#define TN841_TIMER2_COMPB 2
+#define TN841_TIMER2_OVF 3
+#define TN841_USART0_RX 4
+#define TN841_USART0_UDRE 5
+#define TN841_TIMER0_COMPA 6
+#define TN841_VECTORS 7
+
+struct avr_t;
+
+struct avr_t *tn841_make(void);
+extern const uint8_t tn841_vectors[TN841_VECTORS];
+extern const uint16_t tn841_tcnt0;
+extern const uint16_t tn841_spl;
+
+#endif
@@ -0,0 +1,246 @@
+/*
+
+    GPS Clock - song compiler
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// usage: songc songs.txt songs.h chime_songs.py
+//
+// Turns the song descriptions in songs.txt (see the comments there) into
+// the firmware's PROGMEM song tables and the same songs as Python lists
+// for chime.py. Nothing is written unless every song checks out.
+//
+// Each step in the firmware is one byte: the chord in the bottom five bits
+// and, in the top three, an index into a table of waits shared by all of
+// the songs. A rest after a note just makes that note's wait longer, so
+// rests don't take any room unless a song starts with one.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// These have to match GPS_Chime_Clock.c
+#define CHANNELS 5
+#define MAX_WAITS 8
+
+// A song has to fit in the minute before its quarter.
+#define SONG_WINDOW 60000UL
+// The most flash the song tables may take, in bytes.
+#define SONG_FLASH_MAX 256
+
+#define MAX_STEPS 255
+
+static const char *quarter_names[] = { "hour", "first", "second", "third" };
+
+static struct {
+	int line; // where it was defined, or 0
+	int n;
+	uint8_t chord[MAX_STEPS];
+	uint32_t wait[MAX_STEPS];
+} songs[4];
+
+static uint32_t waits[MAX_WAITS];
+static int n_waits;
+
+static const char *fname;
+static int lineno;
+
+static void __attribute__((noreturn, format(printf, 1, 2))) fail(const char *fmt, ...) {
+	va_list ap;
+	if (lineno) fprintf(stderr, "%s:%d: ", fname, lineno);
+	else fprintf(stderr, "%s: ", fname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+static unsigned long number(const char *p, char **end) {
+	if (*p < '0' || *p > '9') fail("expected a number at \"%s\"", p);
+	return strtoul(p, end, 10);
+}
+
+// chord[:beats] or chord:<ms>ms, where chord is - or channels joined with +
+static void parse_step(int s, char *tok, uint32_t beat) {
+	uint8_t chord = 0;
+	char *p = tok;
+	if (*p == '-') {
+		p++;
+	} else {
+		for(;;) {
+			unsigned long ch = number(p, &p);
+			if (ch >= CHANNELS) fail("channel %lu is out of range (0-%d)", ch, CHANNELS - 1);
+			chord |= 1 << ch;
+			if (*p != '+') break;
+			p++;
+		}
+	}
+
+	if (beat == 0) fail("no beat set before the first step");
+	uint32_t wait = beat;
+	if (*p == ':') {
+		unsigned long len = number(p + 1, &p);
+		if (!strcmp(p, "ms")) {
+			wait = len;
+			p += 2;
+		} else {
+			wait = len * beat;
+		}
+	}
+	if (*p != 0) fail("can't make sense of step \"%s\"", tok);
+	if (wait == 0) fail("step \"%s\" takes no time", tok);
+
+	if (chord == 0 && songs[s].n > 0) {
+		songs[s].wait[songs[s].n - 1] += wait;
+		return;
+	}
+	if (songs[s].n == MAX_STEPS) fail("more than %d steps", MAX_STEPS);
+	songs[s].chord[songs[s].n] = chord;
+	songs[s].wait[songs[s].n++] = wait;
+}
+
+static void parse(FILE *f) {
+	char buf[256];
+	int s = -1;
+	uint32_t beat = 0;
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		lineno++;
+		char *p = strchr(buf, '#');
+		if (p != NULL) *p = 0;
+		char *tok = strtok(buf, " \t\r\n");
+		if (tok == NULL) continue;
+		if (!strcmp(tok, "beat")) {
+			tok = strtok(NULL, " \t\r\n");
+			if (tok == NULL) fail("beat needs a length in ms");
+			beat = number(tok, &p);
+			if (*p != 0 || beat == 0) fail("bad beat \"%s\"", tok);
+		} else if (!strcmp(tok, "song")) {
+			tok = strtok(NULL, " \t\r\n");
+			for(s = 0; s < 4; s++)
+				if (tok != NULL && !strcmp(tok, quarter_names[s])) break;
+			if (s == 4) fail("song needs one of hour, first, second or third");
+			if (songs[s].line) fail("%s song already defined on line %d", tok, songs[s].line);
+			songs[s].line = lineno;
+		} else {
+			if (s < 0) fail("step before the first song");
+			do {
+				parse_step(s, tok, beat);
+			} while ((tok = strtok(NULL, " \t\r\n")) != NULL);
+			continue;
+		}
+		if (strtok(NULL, " \t\r\n") != NULL) fail("junk after %s", buf);
+	}
+	lineno = 0;
+}
+
+static uint8_t wait_index(uint32_t wait) {
+	for(int i = 0; i < n_waits; i++)
+		if (waits[i] == wait) return i;
+	if (n_waits == MAX_WAITS) fail("more than %d different step lengths", MAX_WAITS);
+	waits[n_waits] = wait;
+	return n_waits++;
+}
+
+static void check(void) {
+	for(int s = 0; s < 4; s++) {
+		lineno = songs[s].line;
+		if (!lineno) fail("there's no %s song", quarter_names[s]);
+		uint32_t total = 0;
+		uint8_t notes = 0;
+		for(int i = 0; i < songs[s].n; i++) {
+			if (songs[s].wait[i] > UINT16_MAX) fail("a step of %u ms is too long", songs[s].wait[i]);
+			total += songs[s].wait[i];
+			notes |= songs[s].chord[i];
+			wait_index(songs[s].wait[i]);
+		}
+		if (!notes) fail("the %s song has no notes", quarter_names[s]);
+		if (total > SONG_WINDOW) fail("the %s song takes %u ms, more than the %lu ms window", quarter_names[s], total, SONG_WINDOW);
+	}
+	lineno = 0;
+}
+
+static size_t flash_size(void) {
+	size_t size = n_waits * 2;
+	for(int s = 0; s < 4; s++) size += songs[s].n;
+	return size;
+}
+
+static void write_c(FILE *f) {
+	fprintf(f, "// Generated from %s by host/songc. Edit that, not this.\n\n", fname);
+	fprintf(f, "// How long a step waits, indexed by the top three bits of the step.\n");
+	fprintf(f, "const uint16_t PROGMEM song_waits[] = {");
+	for(int i = 0; i < n_waits; i++) fprintf(f, "%s%u", i?", ":" ", waits[i]);
+	fprintf(f, " };\n");
+	for(int s = 0; s < 4; s++) {
+		fprintf(f, "const uint8_t PROGMEM %s_song[] = {", quarter_names[s]);
+		for(int i = 0; i < songs[s].n; i++)
+			fprintf(f, "%s0x%02x", i?", ":" ", (wait_index(songs[s].wait[i]) << 5) | songs[s].chord[i]);
+		fprintf(f, " };\n");
+	}
+}
+
+static void write_py(FILE *f) {
+	fprintf(f, "# Generated from %s by host/songc. Edit that, not this.\n", fname);
+	fprintf(f, "#\n# Each step is (chord, ms): strike the channels in the chord (a bitmask),\n");
+	fprintf(f, "# then wait ms before the next step. A song ends when its last wait does.\n\n");
+	for(int s = 0; s < 4; s++) {
+		fprintf(f, "%s_song = [", quarter_names[s]);
+		for(int i = 0; i < songs[s].n; i++)
+			fprintf(f, "%s(0x%02x, %u)", i?", ":" ", songs[s].chord[i], songs[s].wait[i]);
+		fprintf(f, " ]\n");
+	}
+}
+
+static void write_file(const char *name, void (*writer)(FILE *)) {
+	FILE *f = fopen(name, "w");
+	if (f == NULL) {
+		perror(name);
+		exit(1);
+	}
+	writer(f);
+	if (fclose(f)) {
+		perror(name);
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s songs.txt songs.h songs.py\n", argv[0]);
+		return 1;
+	}
+	fname = argv[1];
+	FILE *f = fopen(fname, "r");
+	if (f == NULL) {
+		perror(fname);
+		return 1;
+	}
+	parse(f);
+	fclose(f);
+	check();
+	if (flash_size() > SONG_FLASH_MAX) fail("the songs take %zu bytes of flash, more than %d", flash_size(), SONG_FLASH_MAX);
+
+	write_file(argv[2], write_c);
+	write_file(argv[3], write_py);
+	printf("%s: %d step lengths, %d + %d + %d + %d steps, %zu bytes of flash\n", fname, n_waits,
+		songs[0].n, songs[1].n, songs[2].n, songs[3].n, flash_size());
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+
+    GPS Clock - timing bus test
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// usage: synctest [-n followers] [-s seconds]
+//
+// Runs a bus master with a good fix and some followers whose receivers
+// never get one, each the real firmware under host/sim.h in its own
+// process, in real time, with oscillators off by different amounts. Each
+// has a pseudo-terminal for its side of the timing bus, and this process
+// copies whatever the master sends on to all of the followers. The run
+// starts at 00:59:10 local time, so there's the hour song and the strike
+// at 1:00. Every follower ought to strike the same chords as the master,
+// each within SYNC_LIMIT of it, and start each second just once, even the
+// first one, whose receiver sends a PPS without a fix.
+//
+// Real time on a shared host is only as good as the scheduler, so run it
+// on a quiet machine. Even on a quiet one, the followers come out a couple
+// of hundred us behind the master. That's how long the master's bytes
+// take to get through the pseudo-terminals, and a real UART doesn't have
+// that delay.
+//
+// The garbled bus bytes are the master's commands to its own receiver at
+// startup. They go out while the followers' receivers are talking, and the
+// followers ignore them anyway. The timing frames go out early in the
+// second, before the receivers start.
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include "../GPS_Chime_Clock.c"
+#undef main
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+
+// 2016-05-26 00:59:10 PDT, which is the blank EEPROM's time zone
+#define SYNC_START (1464249550)
+// The most a follower may be off from the master, in us
+#define SYNC_LIMIT (1000)
+#define NODES_MAX (8)
+
+// Each node's oscillator error, the master's first
+static const double node_ppm[NODES_MAX] = { 300, 2000, -1500, 800, -400, 1200, -2500, 100 };
+
+struct node {
+	pid_t pid;
+	int pty; // our side
+	int result; // a pipe the strikes come back on
+	size_t n_strikes;
+	struct sim_strike strikes[64];
+	int16_t osc_ppm;
+	uint32_t seconds; // started by the main loop
+	uint64_t bus_bytes, bus_garbled;
+};
+
+static struct node nodes[NODES_MAX];
+
+// The master's receiver has a fix the whole time; the followers' never do.
+// Some receivers send the PPS without a fix anyway, so the first follower's
+// does, and it has to go by the timing frames alone all the same.
+static uint8_t gps_master(uint32_t sec) {
+	return SIM_PPS | SIM_RMC | SIM_FIX | SIM_ACK;
+}
+
+static uint8_t gps_follower(uint32_t sec) {
+	return SIM_RMC | SIM_ACK;
+}
+
+static uint8_t gps_follower_pps(uint32_t sec) {
+	return SIM_PPS | SIM_RMC | SIM_ACK;
+}
+
+// Run one clock, and send what it struck back to the parent.
+static void node_run(int i, int bus, int result, uint32_t seconds) {
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	eeprom_write_byte(EE_START_HOUR, 0);
+	eeprom_write_byte(EE_END_HOUR, 23);
+	eeprom_write_byte(EE_SYNC_ROLE, i?SYNC_FOLLOWER:SYNC_MASTER);
+	if (i) sim_bus_in = bus;
+	else sim_bus_out = bus;
+	sim_run(SYNC_START, seconds, node_ppm[i], (i == 0)?gps_master:(i == 1)?gps_follower_pps:gps_follower);
+
+	struct node *n = &(nodes[i]);
+	n->n_strikes = (sim.n_strikes < 64)?sim.n_strikes:64;
+	memcpy(n->strikes, sim.strikes, n->n_strikes * sizeof(n->strikes[0]));
+	n->osc_ppm = stats.osc_ppm;
+	n->seconds = sim.seconds_started;
+	n->bus_bytes = sim.bus_bytes;
+	n->bus_garbled = sim.bus_garbled;
+	if (write(result, n, sizeof(*n)) != sizeof(*n)) _exit(1);
+	_exit(0);
+}
+
+// A pseudo-terminal for a node, in raw mode. Returns our side, and the
+// node's in *node_side.
+static int bus_pty(int *node_side) {
+	int pty = posix_openpt(O_RDWR | O_NOCTTY);
+	if (pty < 0 || grantpt(pty) || unlockpt(pty)) return -1;
+	*node_side = open(ptsname(pty), O_RDWR | O_NOCTTY);
+	if (*node_side < 0) return -1;
+	struct termios tio;
+	if (tcgetattr(*node_side, &tio)) return -1;
+	cfmakeraw(&tio);
+	if (tcsetattr(*node_side, TCSANOW, &tio)) return -1;
+	return pty;
+}
+
+int main(int argc, char **argv) {
+	int followers = 3;
+	uint32_t seconds = 55;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch(opt) {
+			case 'n':
+				followers = atoi(optarg);
+				break;
+			case 's':
+				seconds = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n followers] [-s seconds]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (followers < 1 || followers >= NODES_MAX) {
+		fprintf(stderr, "%s: 1 to %d followers\n", argv[0], NODES_MAX - 1);
+		return 1;
+	}
+	int count = followers + 1;
+
+	// Everyone starts the clock together, once they've all been set up.
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	sim_wall_start = (uint64_t)ts.tv_sec * SIM_NS + ts.tv_nsec + SIM_NS / 2;
+
+	for(int i = 0; i < count; i++) {
+		int node_side, result[2];
+		if ((nodes[i].pty = bus_pty(&node_side)) < 0 || pipe(result)) {
+			perror("pty");
+			return 1;
+		}
+		fflush(stdout);
+		if ((nodes[i].pid = fork()) == 0) {
+			close(result[0]);
+			node_run(i, node_side, result[1], seconds);
+		}
+		close(node_side);
+		close(result[1]);
+		nodes[i].result = result[0];
+	}
+
+	// Be the bus, until the master is done.
+	struct pollfd master = { nodes[0].pty, POLLIN, 0 };
+	while (1) {
+		if (poll(&master, 1, 100) < 0) break;
+		if (master.revents & POLLIN) {
+			uint8_t buf[64];
+			ssize_t len = read(nodes[0].pty, buf, sizeof(buf));
+			if (len <= 0) break;
+			for(int i = 1; i < count; i++) {
+				if (write(nodes[i].pty, buf, len) != len) perror("bus");
+			}
+		} else if (master.revents & (POLLHUP | POLLERR)) {
+			break;
+		}
+		if (waitpid(nodes[0].pid, NULL, WNOHANG) == nodes[0].pid) {
+			nodes[0].pid = 0;
+			break;
+		}
+	}
+
+	int errors = 0;
+	for(int i = 0; i < count; i++) {
+		struct node *n = &(nodes[i]);
+		pid_t pid = n->pid;
+		if (read(n->result, n, sizeof(*n)) != sizeof(*n)) {
+			fprintf(stderr, "node %d didn't finish\n", i);
+			errors++;
+		}
+		if (pid) waitpid(pid, NULL, 0);
+	}
+	if (errors) return 1;
+
+	printf("%d followers, %u s in real time, each within %d us of the master:\n", followers, seconds, SYNC_LIMIT);
+	printf("  master   %+6.0f ppm, %zu strikes\n", node_ppm[0], nodes[0].n_strikes);
+	for(int i = 1; i < count; i++) {
+		struct node *n = &(nodes[i]);
+		printf("  node %d   %+6.0f ppm (estimated %+5d), %u seconds, %zu strikes, %llu bus bytes (%llu garbled), ",
+			i, node_ppm[i], n->osc_ppm, n->seconds, n->n_strikes, (unsigned long long)n->bus_bytes, (unsigned long long)n->bus_garbled);
+		// One each, or the PPS and the timing frames are both starting them.
+		if (n->seconds > seconds + 1) {
+			printf("seconds started twice\n");
+			errors++;
+			continue;
+		}
+		if (n->n_strikes != nodes[0].n_strikes || n->n_strikes == 0) {
+			printf("not the master's strikes\n");
+			errors++;
+			continue;
+		}
+		int64_t worst = 0, total = 0;
+		for(size_t j = 0; j < n->n_strikes; j++) {
+			int64_t err = ((int64_t)n->strikes[j].t - (int64_t)nodes[0].strikes[j].t) / 1000;
+			if (n->strikes[j].chord != nodes[0].strikes[j].chord) worst = INT64_MAX;
+			else if (llabs(err) > llabs(worst)) worst = err;
+			total += err;
+		}
+		if (worst == INT64_MAX) {
+			printf("different chords\n");
+			errors++;
+			continue;
+		}
+		printf("mean %+lld, worst %+lld us\n", (long long)(total / (int64_t)n->n_strikes), (long long)worst);
+		if (llabs(worst) > SYNC_LIMIT) errors++;
+	}
+	return errors?1:0;
+}
@@ -0,0 +1,133 @@
+/*
+
+    GPS Clock - event trace decoder
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// Picks the firmware's trace dump messages out of whatever else was
+// captured from its serial output, and puts the events back in order with
+// their times unwrapped, along with the stats sent after them. Include this
+// after GPS_Chime_Clock.c.
+//
+// The firmware only keeps the bottom 24 bits of the timer count, so this
+// assumes no two events in a row are more than 9 minutes apart. With a PPS,
+// there's at least one every second. The times are at the nominal 32 us a
+// count, which is as far out as the oscillator is.
+
+#ifndef TRACE_DECODE_H
+#define TRACE_DECODE_H
+
+#include <stddef.h>
+
+struct trace_rec {
+	uint8_t type, arg;
+	double ms; // since the oldest event
+};
+
+// How long a TIMER2 count is
+#define TRACE_COUNT_MS (256 * 1000.0 / F_CPU)
+
+static const char *trace_names[] = {
+	[TRACE_PPS] = "PPS", [TRACE_SECOND] = "second", [TRACE_RX] = "rx", [TRACE_CKSUM] = "bad checksum",
+	[TRACE_DROP] = "dropped", [TRACE_SONG] = "song", [TRACE_NOTE_ON] = "note on", [TRACE_NOTE_OFF] = "note off",
+	[TRACE_CMD] = "command", [TRACE_LOCK] = "lock", [TRACE_SYNC] = "timing frame",
+	[TRACE_COUNTING] = "counting seconds", [TRACE_LATE] = "late time label",
+};
+
+static __attribute__((unused)) const char *trace_name(uint8_t type) {
+	if (type >= sizeof(trace_names) / sizeof(trace_names[0]) || trace_names[type] == NULL) return "?";
+	return trace_names[type];
+}
+
+// The stats come low byte first, which is how they are here too, and the
+// struct has no padding on either side.
+_Static_assert(sizeof(struct stats) == 2 * 4 + 14 * 2, "struct stats doesn't match the dump");
+
+// A clock built without the trace dumps no events, and only this much of
+// the stats.
+#define STATS_KEPT offsetof(struct stats, pps_checks)
+
+// Fills out (which has room for TRACE_LEN) and stats (if it isn't NULL)
+// from the last complete dump in the capture. Returns how many events
+// there are, or -1 if there's no complete dump. The stats a dump without
+// events doesn't have come back 0.
+static int trace_decode(const uint8_t *data, size_t len, struct trace_rec *out, struct stats *stats) {
+	uint8_t raw[TRACE_LEN][5];
+	uint8_t raw_stats[sizeof(struct stats)];
+	uint8_t have[TRACE_DUMP_END];
+	int complete = -1;
+	struct trace_rec recs[TRACE_LEN];
+
+	memset(have, 0, sizeof(have));
+	for(size_t i = 0; i + 4 < len; i++) {
+		// A0 A1 len-hi len-lo payload... checksum
+		if (data[i] != 0xa0 || data[i + 1] != 0xa1) continue;
+		size_t plen = (data[i + 2] << 8) | data[i + 3];
+		if (i + 4 + plen >= len) break;
+		const uint8_t *payload = data + i + 4;
+		uint8_t checksum = 0;
+		for(size_t j = 0; j < plen; j++) checksum ^= payload[j];
+		if (plen < 3 || payload[plen] != checksum || payload[0] != TRACE_MSG_ID) continue;
+		uint8_t events = payload[2];
+		if (events != TRACE_LEN && events != 0) continue;
+		i += 4 + plen;
+
+		// Without events, the stats start at 0 in the dump but still go at
+		// TRACE_LEN here.
+		uint8_t first = payload[1];
+		if (first == 0) {
+			// a new dump
+			memset(have, 0, sizeof(have));
+			memset(raw, 0, sizeof(raw));
+			memset(raw_stats, 0, sizeof(raw_stats));
+		}
+		size_t end = events?TRACE_DUMP_END:TRACE_LEN + STATS_KEPT;
+		if (first >= events) {
+			for(size_t j = 0; 3 + j < plen && first - events + TRACE_LEN + j < end; j++) {
+				raw_stats[first - events + j] = payload[3 + j];
+				have[first - events + TRACE_LEN + j] = 1;
+			}
+		}
+		for(size_t j = 0; 3 + j * 5 + 5 <= plen && first + j < events; j++) {
+			memcpy(raw[first + j], payload + 3 + j * 5, 5);
+			have[first + j] = 1;
+		}
+		if (memchr(have + (events?0:TRACE_LEN), 0, end - (events?0:TRACE_LEN)) != NULL) continue;
+
+		// All here. Unwrap the times. Slots that were never written are empty.
+		int n = 0;
+		uint32_t last = 0, counts = 0;
+		for(int k = 0; k < events; k++) {
+			if (raw[k][0] == 0) continue;
+			uint32_t t = ((uint32_t)raw[k][2] << 16) | (raw[k][3] << 8) | raw[k][4];
+			if (n > 0) counts += (t - last) & 0xffffff;
+			last = t;
+			recs[n].type = raw[k][0];
+			recs[n].arg = raw[k][1];
+			recs[n].ms = counts * TRACE_COUNT_MS;
+			n++;
+		}
+		for(int k = n - 1; k >= 0; k--) recs[k].ms -= recs[0].ms;
+		memcpy(out, recs, n * sizeof(*recs));
+		if (stats != NULL) memcpy(stats, raw_stats, sizeof(raw_stats));
+		complete = n;
+	}
+	return complete;
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+
+    GPS Clock - event trace dump decoder
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// usage: tracedump [capture]
+//
+// Reads what the clock sent on its serial TX line after it was sent a
+// TRACE_DUMP_BYTE (0x14) - from the file, or stdin - and prints the last
+// complete dump in it as a timeline, followed by histograms of how long
+// the main loop took to get to each PPS second and how far into its
+// millisecond (counting from the last PPS) each note went on, and what the
+// clock has counted since it started. A clock built without the trace only
+// sends the first few counts.
+
+#include "../GPS_Chime_Clock.c"
+#undef main
+
+#include "trace_decode.h"
+
+void hal_host_poll(void) { }
+
+static void print_arg(const struct trace_rec *r) {
+	static const char *msg_names[] = { [MSG_RMC] = "RMC", [MSG_BINARY] = "binary", [MSG_NAV] = "nav", [MSG_SYNC] = "timing frame" };
+	static const char *quarters[] = { "hour", "first", "second", "third" };
+	switch(r->type) {
+		case TRACE_SECOND:
+			printf(r->arg?" from the PPS":" made up");
+			break;
+		case TRACE_RX:
+			printf(" %s", (r->arg < 5 && msg_names[r->arg])?msg_names[r->arg]:"?");
+			break;
+		case TRACE_DROP:
+			printf(r->arg?", too long":", no free slot");
+			break;
+		case TRACE_SONG:
+			printf(" %s", quarters[r->arg & 3]);
+			break;
+		case TRACE_NOTE_ON:
+		case TRACE_NOTE_OFF:
+			printf(" channels");
+			for(int i = 0; i < 8; i++) {
+				if (r->arg & (1 << i)) printf(" %d", i);
+			}
+			break;
+		case TRACE_CMD:
+			printf(" %d", r->arg);
+			break;
+		case TRACE_LOCK:
+			printf(r->arg?" acquired":" lost");
+			break;
+		case TRACE_SYNC:
+			printf((r->arg & SYNC_LOCKED)?", master has a fix":", master in holdover");
+			break;
+		case TRACE_COUNTING:
+			printf(r->arg?" from the PPS alone":" from the receiver's time");
+			break;
+		case TRACE_LATE:
+			printf(", %.0f ms after the PPS", r->arg * 256 * TRACE_COUNT_MS);
+			break;
+	}
+}
+
+// Bucket width in ms, bucket count
+#define HIST_BUCKET 0.1
+#define HIST_BUCKETS 20
+
+static void histogram(const char *name, const double *ms, int n) {
+	printf("%s, %d:\n", name, n);
+	if (n == 0) return;
+	int count[HIST_BUCKETS] = { 0 };
+	double max = 0;
+	for(int i = 0; i < n; i++) {
+		int b = ms[i] / HIST_BUCKET;
+		count[(b < HIST_BUCKETS)?b:HIST_BUCKETS - 1]++;
+		if (ms[i] > max) max = ms[i];
+	}
+	int last = (int)(max / HIST_BUCKET);
+	if (last >= HIST_BUCKETS) last = HIST_BUCKETS - 1;
+	for(int b = 0; b <= last; b++) {
+		printf("  %s%4.1f ms %4d ", (b == HIST_BUCKETS - 1)?">=":"  ", b * HIST_BUCKET, count[b]);
+		for(int i = 0; i < count[b] * 40 / n; i++) putchar('#');
+		putchar('\n');
+	}
+}
+
+int main(int argc, char **argv) {
+	FILE *f = stdin;
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [capture]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2 && (f = fopen(argv[1], "rb")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	uint8_t *data = NULL;
+	size_t len = 0, size = 0, got;
+	do {
+		if (len == size) {
+			size = size?size * 2:4096;
+			data = realloc(data, size);
+			if (data == NULL) { perror("realloc"); return 1; }
+		}
+		got = fread(data + len, 1, size - len, f);
+		len += got;
+	} while (got > 0);
+
+	struct trace_rec recs[TRACE_LEN];
+	struct stats st;
+	int n = trace_decode(data, len, recs, &st);
+	if (n < 0) {
+		fprintf(stderr, "%s: no complete trace dump\n", argv[0]);
+		return 1;
+	}
+
+	double pps = -1, last_pps = -1, pps_latency[TRACE_LEN], note_late[TRACE_LEN];
+	int n_pps = 0, n_note = 0;
+	for(int i = 0; i < n; i++) {
+		printf("%10.3f ms  %s", recs[i].ms, trace_name(recs[i].type));
+		print_arg(&recs[i]);
+		putchar('\n');
+		if (recs[i].type == TRACE_PPS) pps = last_pps = recs[i].ms;
+		if (recs[i].type == TRACE_SECOND && recs[i].arg && pps >= 0) {
+			pps_latency[n_pps++] = recs[i].ms - pps;
+			pps = -1;
+		}
+		if (recs[i].type == TRACE_NOTE_ON && last_pps >= 0) note_late[n_note++] = fmod(recs[i].ms - last_pps, 1.0);
+	}
+	histogram("PPS to the main loop starting the second", pps_latency, n_pps);
+	histogram("note on, past the start of its ms", note_late, n_note);
+
+	printf("received: %u dropped with every slot full, %u too long, %u bad checksums\n",
+		st.rx_overruns, st.rx_overflows, st.rx_checksum_errors);
+	printf("PPS: last edge %+d us from a tick, oscillator %+d ppm\n", st.pps_phase_us, st.osc_ppm);
+	if (n == 0) {
+		printf("last holdover: %+d ms off when the PPS came back\n", st.holdover_drift_ms);
+		printf("(no events, and no more counts: the clock was built without the trace)\n");
+		return 0;
+	}
+	printf("  %u s counted from it alone, %u checks against the receiver, %u disagreed\n",
+		st.pps_counted, st.pps_checks, st.pps_check_fails);
+	printf("last holdover: %u s, %+d ms off when the PPS came back\n", st.holdover_seconds, st.holdover_drift_ms);
+	printf("time labels: %u late, %u that didn't fit the count\n", st.rx_late, st.rx_mismatches);
+	printf("commands: %u given up on, %u NACKs, %u unasked answers\n", st.cmd_failures, st.cmd_nacks, st.cmd_unsolicited);
+	printf("events dropped: %u\n", st.event_overflows);
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+
+    GPS Clock - POSIX TZ string parser
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// Turns a POSIX TZ string into the firmware's struct tz_rule. Include this
+// after GPS_Chime_Clock.c.
+//
+// std offset [dst [offset] ,Mm.w.d[/time],Mm.w.d[/time]]
+//
+// Offsets and times must be whole quarter hours. The Jn and n forms of
+// the change dates aren't supported.
+
+#ifndef TZ_PARSE_H
+#define TZ_PARSE_H
+
+#include <ctype.h>
+
+static const char *tz_parse_name(const char *p) {
+	if (*p == '<') {
+		p = strchr(p, '>');
+		return (p == NULL)?NULL:p + 1;
+	}
+	const char *start = p;
+	while (isalpha((unsigned char)*p)) p++;
+	return (p - start >= 3)?p:NULL;
+}
+
+// [+|-]hh[:mm[:ss]], in minutes
+static const char *tz_parse_time(const char *p, int *minutes) {
+	int sign = 1, h = 0, m = 0, s = 0;
+	if (*p == '+') p++;
+	else if (*p == '-') { sign = -1; p++; }
+	if (!isdigit((unsigned char)*p)) return NULL;
+	while (isdigit((unsigned char)*p)) h = h * 10 + (*p++ - '0');
+	if (*p == ':') {
+		p++;
+		while (isdigit((unsigned char)*p)) m = m * 10 + (*p++ - '0');
+		if (*p == ':') {
+			p++;
+			while (isdigit((unsigned char)*p)) s = s * 10 + (*p++ - '0');
+		}
+	}
+	if (h > 167 || m > 59 || s != 0) return NULL;
+	*minutes = sign * (h * 60 + m);
+	return p;
+}
+
+static int tz_quarters(int minutes, int8_t *out) {
+	if (minutes % 15 || minutes / 15 < INT8_MIN || minutes / 15 > INT8_MAX) return -1;
+	*out = minutes / 15;
+	return 0;
+}
+
+// ,Mm.w.d[/time]
+static const char *tz_parse_change(const char *p, uint8_t *month, uint8_t *week, uint8_t *dow, int8_t *time) {
+	if (p[0] != ',' || p[1] != 'M') return NULL;
+	char *end;
+	long m = strtol(p + 2, &end, 10);
+	if (*end != '.') return NULL;
+	long w = strtol(end + 1, &end, 10);
+	if (*end != '.') return NULL;
+	long d = strtol(end + 1, &end, 10);
+	if (m < 1 || m > 12 || w < 1 || w > 5 || d < 0 || d > 6) return NULL;
+	p = end;
+	int minutes = 120; // 02:00 is the default
+	if (*p == '/') {
+		p = tz_parse_time(p + 1, &minutes);
+		if (p == NULL) return NULL;
+	}
+	if (tz_quarters(minutes, time)) return NULL;
+	*month = m;
+	*week = w;
+	*dow = d;
+	return p;
+}
+
+// Returns 0 on success.
+static int tz_parse(const char *p, struct tz_rule *rule) {
+	int std, dst;
+	memset(rule, 0, sizeof(*rule));
+
+	p = tz_parse_name(p);
+	if (p == NULL) return -1;
+	p = tz_parse_time(p, &std);
+	if (p == NULL) return -1;
+	std = -std; // POSIX offsets are west of UTC
+	if (tz_quarters(std, &(rule->std_offset))) return -1;
+	if (*p == 0) {
+		rule->dst_offset = rule->std_offset; // no DST
+		return 0;
+	}
+
+	p = tz_parse_name(p);
+	if (p == NULL) return -1;
+	dst = std + 60;
+	if (*p != ',') {
+		p = tz_parse_time(p, &dst);
+		if (p == NULL) return -1;
+		dst = -dst;
+	}
+	if (tz_quarters(dst, &(rule->dst_offset))) return -1;
+
+	p = tz_parse_change(p, &(rule->start_month), &(rule->start_week), &(rule->start_dow), &(rule->start_time));
+	if (p == NULL) return -1;
+	p = tz_parse_change(p, &(rule->end_month), &(rule->end_week), &(rule->end_dow), &(rule->end_time));
+	if (p == NULL || *p != 0) return -1;
+	return 0;
+}
+
+#endif
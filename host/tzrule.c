@@ -0,0 +1,60 @@
+/*
+
+    GPS Clock - time zone rule EEPROM image maker
+    Copyright (C) 2016 Nicholas W. Sayer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+  */
+
+// usage: tzrule 'CET-1CEST,M3.5.0,M10.5.0/3' > tz.hex
+//
+// Writes an Intel hex EEPROM image that selects DST_CUSTOM and holds the
+// given rule. Only those bytes are in the image, so the other settings
+// are left alone when it's written with avrdude.
+
+#include "../GPS_Chime_Clock.c"
+#undef main
+
+#include "tz_parse.h"
+
+void hal_host_poll(void) { }
+
+static void hex_record(uint16_t addr, const uint8_t *data, uint8_t len) {
+	uint8_t sum = len + (addr >> 8) + (addr & 0xff);
+	printf(":%02X%04X00", len, addr);
+	for(int i = 0; i < len; i++) {
+		printf("%02X", data[i]);
+		sum += data[i];
+	}
+	printf("%02X\n", (uint8_t)-sum);
+}
+
+int main(int argc, char **argv) {
+	struct tz_rule rule;
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s posix-tz-string\n", argv[0]);
+		return 1;
+	}
+	if (tz_parse(argv[1], &rule)) {
+		fprintf(stderr, "%s: can't use \"%s\"\n", argv[0], argv[1]);
+		return 1;
+	}
+	uint8_t mode = DST_CUSTOM;
+	hex_record((uintptr_t)EE_DST_MODE, &mode, 1);
+	hex_record((uintptr_t)EE_TZ_RULE, (const uint8_t *)&rule, sizeof(rule));
+	printf(":00000001FF\n");
+	return 0;
+}